@@ -11,21 +11,115 @@
 #include <stdint.h>
 #include <limits.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <inttypes.h>
+#include <sys/prctl.h>
+#include <poll.h>
+#include <signal.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <elf.h>
+#include <link.h>
+#include <glob.h>
+#include <sys/resource.h>
+#include <sys/fanotify.h>
+#include <sys/signalfd.h>
+#include <spawn.h>
+#include <ftw.h>
+#include <sys/ioctl.h>
+#include <sys/file.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <linux/fs.h>
+#include <linux/openat2.h>
+#include <pthread.h>
+#include "mockring.h"
 
 #define MAX_CMD_LEN 100
 #define STACK_SIZE (1024 * 1024)
+#define CONTAINER_ID_MAP "0 1000 1" // uid_map and gid_map, root only
 
 #define CGROUP_PATH "/sys/fs/cgroup/mycgroup"
 #define CGROUP_PROCS_FILE "cgroup.procs"
 #define CGROUP_MEMORY_FILE "memory.max"
 #define CGROUP_CPU_FILE "cpu.max"
+#define CGROUP_CPUSET_FILE "cpuset.cpus"
+#define CGROUP_SUBTREE_FILE "cgroup.subtree_control"
+#define CGROUP_MEMORY_LOW_FILE "memory.low"
+#define CGROUP_MEMORY_MIN_FILE "memory.min"
+#define CGROUP_SWAP_FILE "memory.swap.max"
+#define CGROUP_RECLAIM_FILE "memory.reclaim"
+#define CGROUP_MEMORY_CURRENT_FILE "memory.current"
+#define CGROUP_FREEZE_FILE "cgroup.freeze"
 
+#define MOCKER_RUN_DIR "/run/mocker"
+#define POD_DIR MOCKER_RUN_DIR "/pods"
+#define POD_HOLDER_COMM "mocker-pod"
+#define BOOT_TRACE_DIR "/var/lib/mocker/boot"
+#define CONTAINER_DIR MOCKER_RUN_DIR "/containers"
+#define LAYER_DIR "/var/lib/mocker/layers"
+#define IMAGE_DIR "/var/lib/mocker/images"
 
+
+// Set by `stress` to silence the per-launch progress messages
+static int quiet;
+
+// With --launch=vm the child shares the supervisor's memory until execvp,
+// so everything it reads is a copy that the supervisor never changes and it
+// must not allocate.
 typedef struct child_args {
     char ** cmd_args;
-    int * pipefd; 
+    int pipefd[2];
+    int thp;
+    int in_pod;             // UTS is shared with the pod, keep its hostname
+    int ring_fd;            // memfd of the request ring, -1 without --ring
+    char ** envp;           // environment for execvpe, built by the supervisor
+    int init;               // run container_init() as PID 1 instead of exec'ing
 } child_args;
 
+enum { THP_DEFAULT, THP_NEVER, THP_MADVISE };
+
+#ifndef PR_THP_DISABLE_EXCEPT_ADVISED
+#define PR_THP_DISABLE_EXCEPT_ADVISED (1 << 1)
+#endif
+
+// Memory settings applied to the container cgroup and, for THP, to the
+// child before exec. NULL leaves the kernel default in place.
+typedef struct memory_profile {
+    const char * name;
+    const char * memory_max;
+    const char * memory_low;
+    const char * memory_min;
+    const char * swap_max;
+    const char * hugetlb_max;       // applied to every hugetlb.<size>.max
+    int thp;
+    int reclaim_interval_ms;        // proactive reclaim when idle, 0: off
+    const char * reclaim_amount;
+} memory_profile;
+
+typedef struct run_options {
+    int perf;               // count PMU events on the container cgroup
+    int perf_interval_ms;   // 0: report once at exit
+    memory_profile memory;
+    const char * pod;       // join this pod's IPC, net and UTS namespaces
+    const char * auto_deps; // binary to install with its shared libraries
+    const char * name;      // container name, defaults to the temp dir's
+    uint32_t ring_size;     // bytes per request/response queue, 0: no ring
+    int record_boot_ms;     // record a boot trace over this window, 0: replay one
+    const char * image;     // layers to apply on top of the root
+    int snapshot;           // record the root's manifest for `mocker commit`
+    int launch_vm;          // clone with CLONE_VM instead of copying the supervisor
+    int init;               // built-in PID 1 that reaps and forwards signals
+    double cpus;            // cpu.max in CPUs, 0: DEFAULT_CPUS
+    int cpuset;             // CPUs reserved for the container alone, 0: none
+    int priority;           // PRIO_LOW, PRIO_NORMAL or PRIO_HIGH
+    const char * tenant;    // queue fairly between tenants, NULL: "default"
+    int admit;              // ADMIT_QUEUE, ADMIT_REJECT or ADMIT_FORCE
+    int queue_timeout_s;    // give up waiting for capacity, 0: never
+} run_options;
+
 int setup_temp_dir(char *temp_dir) {
     // Create a temporary directory in /tmp
     strcpy(temp_dir, "/tmp/mockerXXXXXX");
@@ -100,289 +194,5178 @@ int setup_temp_dir(char *temp_dir) {
     return 0;
 }
 
-int create_cgroup(const char *cgroup_path) {
-    if (mkdir(cgroup_path, 0755) != 0) {
-        if (errno != EEXIST) {
-            perror("mkdir");
+// Minimal-closure roots: parse the ELF headers of a binary ourselves
+// (PT_INTERP, DT_NEEDED, DT_RPATH/DT_RUNPATH), resolve the transitive set of
+// shared libraries the way ld.so would, and hardlink (or copy) only those
+// files into the container root.
+#define ELFCLASSNATIVE (__ELF_NATIVE_CLASS == 64 ? ELFCLASS64 : ELFCLASS32)
+
+typedef struct path_list {
+    char ** paths;
+    size_t count;
+    size_t cap;
+} path_list;
+
+static int path_list_add(path_list *pl, const char *path) {
+    for (size_t i = 0; i < pl->count; i++)
+        if (strcmp(pl->paths[i], path) == 0)
+            return 0;
+    if (pl->count == pl->cap) {
+        size_t cap = pl->cap ? pl->cap * 2 : 16;
+        char ** paths = realloc(pl->paths, sizeof(char *) * cap);
+        if (!paths)
             return -1;
-        }
+        pl->paths = paths;
+        pl->cap = cap;
     }
-    fprintf(stdout, "created c group\n");
+    pl->paths[pl->count] = strdup(path);
+    if (!pl->paths[pl->count])
+        return -1;
+    pl->count++;
     return 0;
 }
 
-int set_cgroup_value(const char *cgroup_path, const char *file, const char *value) {
-    char filepath[256];
-    snprintf(filepath, sizeof(filepath), "%s/%s", cgroup_path, file);
-    FILE * fp = fopen(filepath, "wb");
-    if (!fp)
-    {
-        perror("fopen");
-        return -1;
-    }
-    fprintf(fp, "%s", value);
-    fclose(fp);
-    return 0;
+static void path_list_free(path_list *pl) {
+    for (size_t i = 0; i < pl->count; i++)
+        free(pl->paths[i]);
+    free(pl->paths);
+    memset(pl, 0, sizeof(*pl));
 }
 
-int add_pid_to_cgroup(const char *cgroup_path, pid_t pid) {
-    char pid_str[16];
-    snprintf(pid_str, sizeof(pid_str), "%d", pid);
-    return set_cgroup_value(cgroup_path, CGROUP_PROCS_FILE, pid_str);
+typedef struct elf_info {
+    unsigned char elf_class;
+    uint16_t machine;
+    char interp[PATH_MAX];
+    path_list needed;
+    char rpath[PATH_MAX];
+    char runpath[PATH_MAX];
+} elf_info;
+
+static uint64_t elf_vaddr_to_offset(const ElfW(Phdr) *phdr, size_t phnum, uint64_t vaddr) {
+    for (size_t i = 0; i < phnum; i++) {
+        if (phdr[i].p_type == PT_LOAD && vaddr >= phdr[i].p_vaddr && vaddr < phdr[i].p_vaddr + phdr[i].p_filesz)
+            return vaddr - phdr[i].p_vaddr + phdr[i].p_offset;
+    }
+    return UINT64_MAX;
 }
 
-static void update_map(char *mapping, char *map_file) {
-    int fd;
-    size_t map_len;
+// Only the native ELF class is parsed; a mismatching library (e.g. a 32 bit
+// copy found in /usr/lib) is reported through elf_class so the search can
+// skip it.
+static int elf_read(const char *path, elf_info *ei) {
+    memset(ei, 0, sizeof(*ei));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t) sizeof(ElfW(Ehdr))) {
+        close(fd);
+        return -1;
+    }
+    size_t size = st.st_size;
+    unsigned char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
 
-    map_len = strlen(mapping);
-    for (size_t j = 0; j < map_len; j++)
-        if (mapping[j] == ',')
-            mapping[j] = '\n';
+    int ret = -1;
+    const ElfW(Ehdr) *ehdr = (const ElfW(Ehdr) *) map;
+    if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0)
+        goto out;
+    ei->elf_class = ehdr->e_ident[EI_CLASS];
+    ei->machine = ehdr->e_machine;
+    if (ei->elf_class != ELFCLASSNATIVE) {
+        ret = 0;
+        goto out;
+    }
+    if (ehdr->e_phoff + (uint64_t) ehdr->e_phnum * sizeof(ElfW(Phdr)) > size)
+        goto out;
 
-    fd = open(map_file, O_RDWR);
-    if (fd == -1) {
-        fprintf(stderr, "ERROR: open %s: %s\n", map_file, strerror(errno));
-        exit(EXIT_FAILURE);
+    const ElfW(Phdr) *phdr = (const ElfW(Phdr) *) (map + ehdr->e_phoff);
+    const ElfW(Dyn) *dyn = NULL;
+    size_t dyn_count = 0;
+    for (size_t i = 0; i < ehdr->e_phnum; i++) {
+        if (phdr[i].p_offset + phdr[i].p_filesz > size)
+            continue;
+        if (phdr[i].p_type == PT_INTERP && phdr[i].p_filesz < sizeof(ei->interp)) {
+            memcpy(ei->interp, map + phdr[i].p_offset, phdr[i].p_filesz);
+            ei->interp[phdr[i].p_filesz] = '\0';
+        } else if (phdr[i].p_type == PT_DYNAMIC) {
+            dyn = (const ElfW(Dyn) *) (map + phdr[i].p_offset);
+            dyn_count = phdr[i].p_filesz / sizeof(ElfW(Dyn));
+        }
     }
+    ret = 0;
+    if (!dyn)
+        goto out;   // static binary
 
-    if (write(fd, mapping, map_len) != map_len) {
-        fprintf(stderr, "ERROR: write %s: %s\n", map_file, strerror(errno));
-        exit(EXIT_FAILURE);
+    uint64_t strtab = UINT64_MAX;
+    for (size_t i = 0; i < dyn_count && dyn[i].d_tag != DT_NULL; i++)
+        if (dyn[i].d_tag == DT_STRTAB)
+            strtab = elf_vaddr_to_offset(phdr, ehdr->e_phnum, dyn[i].d_un.d_ptr);
+    if (strtab >= size) {
+        ret = -1;
+        goto out;
+    }
+    const char *strs = (const char *) map + strtab;
+    size_t strs_size = size - strtab;
+    for (size_t i = 0; i < dyn_count && dyn[i].d_tag != DT_NULL; i++) {
+        uint64_t off = dyn[i].d_un.d_val;
+        if (off >= strs_size || !memchr(strs + off, '\0', strs_size - off))
+            continue;
+        if (dyn[i].d_tag == DT_NEEDED) {
+            if (path_list_add(&ei->needed, strs + off) != 0) {
+                ret = -1;
+                goto out;
+            }
+        } else if (dyn[i].d_tag == DT_RPATH) {
+            snprintf(ei->rpath, sizeof(ei->rpath), "%s", strs + off);
+        } else if (dyn[i].d_tag == DT_RUNPATH) {
+            snprintf(ei->runpath, sizeof(ei->runpath), "%s", strs + off);
+        }
     }
 
-    close(fd);
+out:
+    munmap(map, size);
+    if (ret != 0)
+        path_list_free(&ei->needed);
+    return ret;
 }
 
-static void proc_setgroups_write(pid_t child_pid, char *str) {
-    char setgroups_path[PATH_MAX];
-    int fd;
-
-    snprintf(setgroups_path, PATH_MAX, "/proc/%jd/setgroups", (intmax_t) child_pid);
+// Appends the directories of a colon separated search path, expanding
+// $ORIGIN to the directory of the object that carries it.
+static void add_search_path(path_list *dirs, const char *search, const char *origin) {
+    char buf[PATH_MAX];
+    snprintf(buf, sizeof(buf), "%s", search);
+    for (char *save = NULL, *dir = strtok_r(buf, ":", &save); dir; dir = strtok_r(NULL, ":", &save)) {
+        char expanded[PATH_MAX];
+        if (strncmp(dir, "$ORIGIN", 7) == 0)
+            snprintf(expanded, sizeof(expanded), "%s%s", origin, dir + 7);
+        else if (strncmp(dir, "${ORIGIN}", 9) == 0)
+            snprintf(expanded, sizeof(expanded), "%s%s", origin, dir + 9);
+        else
+            snprintf(expanded, sizeof(expanded), "%s", dir);
+        path_list_add(dirs, expanded);
+    }
+}
 
-    fd = open(setgroups_path, O_RDWR);
-    if (fd == -1) {
-        if (errno != ENOENT)
-            fprintf(stderr, "ERROR: open %s: %s\n", setgroups_path, strerror(errno));
+static void read_ld_so_conf(path_list *dirs, const char *conf, int depth) {
+    FILE *fp = fopen(conf, "r");
+    if (!fp || depth > 4) {
+        if (fp)
+            fclose(fp);
         return;
     }
-
-    if (write(fd, str, strlen(str)) == -1)
-        fprintf(stderr, "ERROR: write %s: %s\n", setgroups_path, strerror(errno));
-
-    close(fd);
+    char line[PATH_MAX];
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "#\n")] = '\0';
+        char *p = line + strspn(line, " \t");
+        if (!*p)
+            continue;
+        if (strncmp(p, "include", 7) == 0 && (p[7] == ' ' || p[7] == '\t')) {
+            p += 7 + strspn(p + 7, " \t");
+            glob_t g;
+            if (glob(p, 0, NULL, &g) == 0) {
+                for (size_t i = 0; i < g.gl_pathc; i++)
+                    read_ld_so_conf(dirs, g.gl_pathv[i], depth + 1);
+                globfree(&g);
+            }
+        } else {
+            path_list_add(dirs, p);
+        }
+    }
+    fclose(fp);
 }
 
-int run_command(void * args)
-{
-    child_args * ca = (child_args *) args;
-    int * pipefd = ca->pipefd;
-    char ** cmd_args = ca->cmd_args;
-    char * temp_dir = cmd_args[0];
-    char * command = cmd_args[1];
+// The directories every library search falls back to: ld.so.conf (which
+// is what ld.so.cache is built from) and the built-in defaults.
+static void default_search_dirs(path_list *dirs) {
+    static const char * builtin[] = { "/lib64", "/usr/lib64", "/lib", "/usr/lib" };
+    read_ld_so_conf(dirs, "/etc/ld.so.conf", 0);
+    for (size_t i = 0; i < sizeof(builtin) / sizeof(builtin[0]); i++)
+        path_list_add(dirs, builtin[i]);
+}
 
+static void path_dir(char *dir, size_t size, const char *path) {
+    snprintf(dir, size, "%s", path);
+    char *slash = strrchr(dir, '/');
+    if (slash)
+        *slash = '\0';
+}
 
-    // NOTE: Needed if calling clone with CLONE_NEWNS?
-    // Unshare the mount namespace to isolate it from the host
-    if (unshare(CLONE_NEWNS) == -1) {
-        perror("unshare");
-        return EXIT_FAILURE;
+// $ORIGIN in a search path is the directory of the object whose dynamic
+// section carries it, so the executable's DT_RPATH uses the executable's.
+static int resolve_library(const char *name, const elf_info *parent, const char *parent_path,
+                           const elf_info *exe, const char *exe_path, const path_list *system_dirs,
+                           char *resolved, size_t size) {
+    if (strchr(name, '/')) {
+        snprintf(resolved, size, "%s", name);
+        return access(resolved, R_OK);
     }
 
+    char origin[PATH_MAX], exe_origin[PATH_MAX];
+    path_dir(origin, sizeof(origin), parent_path);
+    path_dir(exe_origin, sizeof(exe_origin), exe_path);
 
-    char * namespace = "new_namespace";
-    if (sethostname(namespace, strlen(namespace)) == -1)
-    {
-        perror("sethostname");
-        return EXIT_FAILURE;
+    // ld.so order: DT_RPATH (ignored when DT_RUNPATH exists), DT_RUNPATH,
+    // then the system directories
+    path_list dirs = {0};
+    if (!parent->runpath[0]) {
+        if (parent->rpath[0])
+            add_search_path(&dirs, parent->rpath, origin);
+        if (exe != parent && exe->rpath[0] && !exe->runpath[0])
+            add_search_path(&dirs, exe->rpath, exe_origin);
+    } else {
+        add_search_path(&dirs, parent->runpath, origin);
     }
+    for (size_t i = 0; i < system_dirs->count; i++)
+        path_list_add(&dirs, system_dirs->paths[i]);
 
-    // Change root directory to the temporary directory
-    if (chroot(temp_dir) == -1)
-    {
-        perror("chroot");
-        return EXIT_FAILURE;
+    int ret = -1;
+    for (size_t i = 0; i < dirs.count && ret != 0; i++) {
+        if (snprintf(resolved, size, "%s/%s", dirs.paths[i], name) >= size || access(resolved, R_OK) != 0)
+            continue;
+        elf_info candidate;
+        if (elf_read(resolved, &candidate) != 0)
+            continue;
+        if (candidate.elf_class == exe->elf_class && candidate.machine == exe->machine)
+            ret = 0;
+        path_list_free(&candidate.needed);
     }
+    path_list_free(&dirs);
+    return ret;
+}
 
-    // Change working directory to root
-    if (chdir("/") == -1)
-    {
-        perror("chdir");
-        return EXIT_FAILURE;
+// Computes the binary, its interpreter and every shared library reachable
+// through DT_NEEDED, as absolute host paths.
+int elf_closure(const char *binary, path_list *closure) {
+    char exe_path[PATH_MAX];
+    if (!realpath(binary, exe_path)) {
+        fprintf(stderr, "ERROR: realpath %s: %s\n", binary, strerror(errno));
+        return -1;
     }
-
-    // Mount /proc
-    if (mount("proc", "/proc", "proc", 0, NULL) == -1) {
-        perror("mount /proc");
-        return EXIT_FAILURE;
+    elf_info exe;
+    if (elf_read(exe_path, &exe) != 0 || exe.elf_class != ELFCLASSNATIVE) {
+        fprintf(stderr, "%s is not a native ELF binary\n", binary);
+        return -1;
     }
 
+    path_list system_dirs = {0};
+    default_search_dirs(&system_dirs);
 
-    close(pipefd[1]);
+    int ret = 0;
+    path_list_add(closure, binary[0] == '/' ? binary : exe_path);
+    if (exe.interp[0])
+        path_list_add(closure, exe.interp);
 
-    char buffer;
-    if (read(pipefd[0], &buffer, 1) != 1) {
-        perror("read");
-        return 1;
+    // Breadth first over the closure list itself; every entry after the
+    // interpreter gets its DT_NEEDED entries resolved exactly once
+    for (size_t i = 0; i < closure->count && ret == 0; i++) {
+        char real[PATH_MAX];
+        elf_info ei;
+        if (!realpath(closure->paths[i], real) || elf_read(real, &ei) != 0) {
+            fprintf(stderr, "ERROR: cannot read %s\n", closure->paths[i]);
+            ret = -1;
+            break;
+        }
+        for (size_t j = 0; j < ei.needed.count; j++) {
+            char resolved[PATH_MAX];
+            if (resolve_library(ei.needed.paths[j], &ei, real, &exe, exe_path, &system_dirs, resolved, sizeof(resolved)) != 0) {
+                fprintf(stderr, "ERROR: %s: cannot find %s\n", closure->paths[i], ei.needed.paths[j]);
+                ret = -1;
+                break;
+            }
+            if (path_list_add(closure, resolved) != 0) {
+                ret = -1;
+                break;
+            }
+        }
+        path_list_free(&ei.needed);
     }
-    close(pipefd[0]);
-    
-    execvp(command, &cmd_args[1]);
-    perror("execvp");
 
-    // This code will only be reached if execvp fails
-    // Unmount /proc before exiting
-    if (umount("/proc") == -1) {
-        perror("umount /proc");
-    }
-    rmdir("/proc");
+    path_list_free(&exe.needed);
+    path_list_free(&system_dirs);
+    return ret;
+}
 
-    return EXIT_FAILURE;
+static int mkdir_parents(char *path) {
+    for (char *p = strchr(path + 1, '/'); p; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        int ret = mkdir(path, 0755);
+        *p = '/';
+        if (ret == -1 && errno != EEXIST)
+            return -1;
+    }
+    return 0;
 }
 
-int main(int argc, char ** args)
-{
-    char * first = args[0];
+#define COPY_CLONE 0
+#define COPY_RANGE 1
+#define COPY_SPLICE 2
 
-    if (argc < 3) {
-        fprintf(stderr, "Usage: %s run <command> <args>\n", first);
-        return EXIT_FAILURE;
+// Moves size bytes from in to out without a userspace buffer: a reflink
+// when the filesystem shares extents, copy_file_range() within a
+// filesystem, and splice() through a pipe when neither applies. Returns
+// the COPY_* method used, -1 on error.
+int copy_fd(int in, int out, off_t size) {
+    if (size > 0 && ioctl(out, FICLONE, in) == 0)
+        return COPY_CLONE;
+
+    off_t left = size;
+    while (left > 0) {
+        ssize_t n = copy_file_range(in, NULL, out, NULL, left, 0);
+        if (n < 0 && left == size && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+            break;      // not supported between these files, splice instead
+        if (n <= 0)
+            return -1;
+        left -= n;
     }
+    if (left == 0)
+        return COPY_RANGE;
 
-    char * second = args[1];
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) == -1)
+        return -1;
+    while (left > 0) {
+        ssize_t n = splice(in, NULL, pipefd[1], NULL, left < (1 << 20) ? left : (1 << 20), SPLICE_F_MOVE);
+        if (n <= 0)
+            break;
+        ssize_t moved = 0;
+        while (moved < n) {
+            ssize_t m = splice(pipefd[0], NULL, out, NULL, n - moved, SPLICE_F_MOVE);
+            if (m <= 0)
+                break;
+            moved += m;
+        }
+        if (moved < n)
+            break;
+        left -= n;
+    }
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return left == 0 ? COPY_SPLICE : -1;
+}
 
-    if (strcmp(second, "run") != 0)
-    {
-        fprintf(stderr, "Unrecognized second argument.\nUsage: %s run <command> <args>\n", first);
-        return EXIT_FAILURE;
+int copy_file(const char *src, const char *dst) {
+    int in = open(src, O_RDONLY | O_CLOEXEC);
+    if (in == -1)
+        return -1;
+    struct stat st;
+    if (fstat(in, &st) == -1) {
+        close(in);
+        return -1;
+    }
+    int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st.st_mode & 07777);
+    if (out == -1) {
+        close(in);
+        return -1;
     }
+    int method = copy_fd(in, out, st.st_size);
+    close(in);
+    if (close(out) == -1 || method < 0)
+        return -1;
+    return 0;
+}
 
-    // Setup temporary directory
-    char temp_dir[1024];
-    if (setup_temp_dir(temp_dir) == -1) {
-        return EXIT_FAILURE;
+// openat2() of path below root_fd, with the RESOLVE_* flags in resolve
+static int open_in_root(int root_fd, const char *path, int flags, mode_t mode, uint64_t resolve) {
+    struct open_how how = {
+        .flags = flags | O_CLOEXEC,
+        .mode = (flags & O_CREAT) ? mode : 0,
+        .resolve = resolve,
+    };
+    return syscall(SYS_openat2, root_fd, path, &how, sizeof(how));
+}
+
+// Places a copy of host file src at the same absolute path inside root. It
+// is not hardlinked: the container's root user could then write to the
+// host's file. copy_fd() still shares extents where the filesystem can.
+static int install_file(const char *root, const char *src) {
+    char real[PATH_MAX];
+    if (!realpath(src, real))
+        return -1;
+    char dst[PATH_MAX];
+    if (snprintf(dst, sizeof(dst), "%s%s", root, src) >= sizeof(dst)) {
+        errno = ENAMETOOLONG;
+        return -1;
     }
+    if (mkdir_parents(dst) == -1)
+        return -1;
+    // Replaces busybox applet symlinks of the same name
+    unlink(dst);
+    return copy_file(real, dst);
+}
 
-    char ** cmd_args = malloc(sizeof(char *) * (argc - 1 + 1)); // range is args[2] til args[argc - 1], size therefore is argc - 2, but we need 1 for the NULL terminator, and 1 for temp_dir, so argc - 1 + 1
-    if (!cmd_args) {
-        perror("malloc");
-        return EXIT_FAILURE;
+int install_closure(const char *root, const char *binary) {
+    path_list closure = {0};
+    if (elf_closure(binary, &closure) != 0) {
+        path_list_free(&closure);
+        return -1;
     }
-    cmd_args[0] = temp_dir;
-    for (int i = 2; i < argc; i++)
-    {
-        cmd_args[i - 1] = args[i];
+    int ret = 0;
+    for (size_t i = 0; i < closure.count; i++) {
+        if (install_file(root, closure.paths[i]) != 0) {
+            fprintf(stderr, "ERROR: install %s: %s\n", closure.paths[i], strerror(errno));
+            ret = -1;
+            break;
+        }
     }
-    cmd_args[argc - 1] = NULL;
+    if (ret == 0 && !quiet)
+        printf("Installed %s with %zu dependencies\n", binary, closure.count - 1);
+    path_list_free(&closure);
+    return ret;
+}
 
-    char * stack = malloc(STACK_SIZE);
-    if (stack == NULL)
-    {
-        perror("malloc");
-        free(cmd_args);
-        return EXIT_FAILURE;
+// Finds the host file that setup_temp_dir() or install_closure() copied to
+// rel in the root, given the closure install_closure() was called with.
+// Fills src (PATH_MAX) and returns 0, or -1 if rel was not copied from the
+// host, e.g. a file from an image layer.
+static int root_source(const path_list *closure, const char *rel, char *src) {
+    const char *host = NULL;
+    if (strcmp(rel, "/bin/busybox") == 0)
+        host = rel;
+    else if (strcmp(rel, "/cputest") == 0 || strcmp(rel, "/memtest") == 0)
+        host = rel + 1;     // copied from the supervisor's cwd
+    for (size_t i = 0; !host && i < closure->count; i++)
+        if (strcmp(closure->paths[i], rel) == 0)
+            host = rel;     // installed at its own path
+    return host && realpath(host, src) ? 0 : -1;
+}
+
+// Kernel interface. The supervisor's cgroupfs and procfs accesses, mounts,
+// namespace calls and child plumbing go through kops, so the same code runs
+// against the kernel or against the in-memory fake used by kernel-bench.
+typedef struct kernel_ops {
+    const char * name;
+    int (*mkdir)(const char *path, mode_t mode);
+    int (*rmdir)(const char *path);
+    int (*exists)(const char *path);
+    // Whole-file write and read of a pseudo file, -1 with errno on failure
+    ssize_t (*write_file)(const char *path, const char *buf, size_t len);
+    ssize_t (*read_file)(const char *path, char *buf, size_t size);
+    pid_t (*clone)(int (*fn)(void *), void *stack, int flags, void *arg);
+    int (*kill)(pid_t pid, int sig);
+    pid_t (*getpid)(void);
+    pid_t (*waitpid)(pid_t pid, int *status, int options);
+    int (*setns)(int fd, int nstype);
+    int (*unshare)(int flags);
+    int (*mount)(const char *source, const char *target, const char *fstype, unsigned long flags, const void *data);
+    int (*umount)(const char *target);
+    int (*pipe)(int fds[2]);
+    ssize_t (*write)(int fd, const void *buf, size_t len);
+    int (*close)(int fd);
+} kernel_ops;
+
+static int real_exists(const char *path) {
+    return access(path, F_OK) == 0;
+}
+
+static ssize_t real_write_file(const char *path, const char *buf, size_t len) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1)
+        return -1;
+    ssize_t n = write(fd, buf, len);
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return n;
+}
+
+static ssize_t real_read_file(const char *path, char *buf, size_t size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    ssize_t n = read(fd, buf, size);
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return n;
+}
+
+static pid_t real_clone(int (*fn)(void *), void *stack, int flags, void *arg) {
+    return clone(fn, stack, flags, arg);
+}
+
+static const kernel_ops real_kernel = {
+    "real", mkdir, rmdir, real_exists, real_write_file, real_read_file, real_clone,
+    kill, getpid, waitpid, setns, unshare, mount, umount, pipe, write, close,
+};
+
+static const kernel_ops * kops = &real_kernel;
+
+// The container's name is taken by creating its cgroup, so an existing one
+// means the name is in use.
+int create_cgroup(const char *cgroup_path) {
+    if (kops->mkdir(cgroup_path, 0755) != 0) {
+        if (errno == EEXIST)
+            fprintf(stderr, "container %s already exists\n", strrchr(cgroup_path, '/') + 1);
+        else
+            perror("mkdir");
+        return -1;
     }
+    if (!quiet)
+        fprintf(stdout, "created c group\n");
+    return 0;
+}
 
-    int pipefd[2];
-    if (pipe(pipefd) != 0) {
-        perror("pipe");
-        return 1;
+int set_cgroup_value(const char *cgroup_path, const char *file, const char *value) {
+    char filepath[PATH_MAX];
+    snprintf(filepath, sizeof(filepath), "%s/%s", cgroup_path, file);
+    if (kops->write_file(filepath, value, strlen(value)) == -1) {
+        fprintf(stderr, "ERROR: write %s: %s\n", filepath, strerror(errno));
+        return -1;
     }
+    return 0;
+}
 
-    child_args * ca = (child_args *)malloc(sizeof(child_args));
-    ca->cmd_args = cmd_args;
-    ca->pipefd = pipefd;
+int add_pid_to_cgroup(const char *cgroup_path, pid_t pid) {
+    char pid_str[16];
+    snprintf(pid_str, sizeof(pid_str), "%d", pid);
+    return set_cgroup_value(cgroup_path, CGROUP_PROCS_FILE, pid_str);
+}
 
+// Hardware counters scoped to the container cgroup. cgroup mode needs one
+// event per cpu; when that is refused (perf_event_paranoid, no CAP_PERFMON)
+// we fall back to inherited per-task counters on the child, and when the PMU
+// itself is unavailable (VMs, locked down hosts) only the software counters
+// are kept.
+typedef struct perf_counter {
+    const char * name;
+    uint32_t type;
+    uint64_t config;
+    int * fds;
+    uint64_t value;
+    uint64_t last;
+} perf_counter;
 
-    // Create a new UTS, mount, and PID namespace
-    pid_t pid = clone(run_command, stack + STACK_SIZE, CLONE_NEWUSER | CLONE_NEWNET | CLONE_NEWIPC | CLONE_NEWUTS | CLONE_NEWNS | CLONE_NEWPID | SIGCHLD, ca);
+enum {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_REFS,
+    PERF_CACHE_MISSES,
+    PERF_BRANCHES,
+    PERF_BRANCH_MISSES,
+    PERF_TASK_CLOCK,
+    PERF_CONTEXT_SWITCHES,
+    PERF_PAGE_FAULTS,
+    PERF_COUNTER_COUNT
+};
 
-    if (pid == -1) {
-        perror("clone");
-        free(stack);
-        free(cmd_args);
-        return EXIT_FAILURE;
-    }
+typedef struct perf_session {
+    int ncpus;
+    int cgroup_mode;
+    int hardware;
+    perf_counter counters[PERF_COUNTER_COUNT];
+} perf_session;
 
+static const perf_counter perf_counter_defs[PERF_COUNTER_COUNT] = {
+    [PERF_CYCLES]           = { "cycles",           PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    [PERF_INSTRUCTIONS]     = { "instructions",     PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    [PERF_CACHE_REFS]       = { "cache-references", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES },
+    [PERF_CACHE_MISSES]     = { "cache-misses",     PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    [PERF_BRANCHES]         = { "branches",         PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS },
+    [PERF_BRANCH_MISSES]    = { "branch-misses",    PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    [PERF_TASK_CLOCK]       = { "task-clock",       PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+    [PERF_CONTEXT_SWITCHES] = { "context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+    [PERF_PAGE_FAULTS]      = { "page-faults",      PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+};
 
-    char map_path[PATH_MAX];
+static int perf_event_open(struct perf_event_attr *attr, pid_t pid, int cpu, int group_fd, unsigned long flags) {
+    return syscall(SYS_perf_event_open, attr, pid, cpu, group_fd, flags);
+}
 
-    snprintf(map_path, PATH_MAX, "/proc/%ld/uid_map",  (intmax_t) pid);
-    update_map("0 1000 1", map_path);
-    printf("Updated UID map: %s\n", map_path);
+static void perf_close_counter(perf_session *ps, perf_counter *pc) {
+    if (!pc->fds)
+        return;
+    for (int cpu = 0; cpu < ps->ncpus; cpu++)
+        if (pc->fds[cpu] >= 0)
+            close(pc->fds[cpu]);
+    free(pc->fds);
+    pc->fds = NULL;
+}
 
+// Returns 0 when at least one event is open, otherwise -1 with errno from
+// the first failure.
+static int perf_open_counter(perf_session *ps, perf_counter *pc, int cgroup_fd, pid_t pid) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = pc->type;
+    attr.config = pc->config;
+    attr.disabled = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
 
-    snprintf(map_path, PATH_MAX, "/proc/%ld/gid_map", (intmax_t) pid);
-    proc_setgroups_write(pid, "deny");
-    printf("Setgroups set to deny for: %s\n", map_path);
-    update_map("0 1000 1", map_path);
-    printf("Updated GID map: %s\n", map_path);
+    int nfds = ps->cgroup_mode ? ps->ncpus : 1;
+    pc->fds = malloc(sizeof(int) * ps->ncpus);
+    if (!pc->fds)
+        return -1;
+    for (int cpu = 0; cpu < ps->ncpus; cpu++)
+        pc->fds[cpu] = -1;
 
-    // Create and configure cgroup
-    if (create_cgroup(CGROUP_PATH) != 0) {
-        return 1;
-    }
-    if (set_cgroup_value(CGROUP_PATH, CGROUP_MEMORY_FILE, "10000000") != 0) {  // 10 MB
-        return 1;
+    int opened = 0;
+    int first_errno = 0;
+    for (int cpu = 0; cpu < nfds; cpu++) {
+        int fd;
+        if (ps->cgroup_mode) {
+            fd = perf_event_open(&attr, cgroup_fd, cpu, -1, PERF_FLAG_PID_CGROUP | PERF_FLAG_FD_CLOEXEC);
+        } else {
+            attr.inherit = 1;
+            fd = perf_event_open(&attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+            if (fd == -1 && (errno == EACCES || errno == EPERM)) {
+                // perf_event_paranoid >= 2: user space only
+                attr.exclude_kernel = 1;
+                fd = perf_event_open(&attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+            }
+        }
+        if (fd == -1) {
+            // Offline cpus report ENODEV, keep going
+            if (!first_errno && errno != ENODEV)
+                first_errno = errno;
+            continue;
+        }
+        pc->fds[cpu] = fd;
+        opened++;
     }
-    if (set_cgroup_value(CGROUP_PATH, CGROUP_CPU_FILE, "10000 100000") != 0) {  // 10% of a CPU
-        return 1;
+
+    if (!opened) {
+        perf_close_counter(ps, pc);
+        errno = first_errno ? first_errno : ENODEV;
+        return -1;
     }
-    if (add_pid_to_cgroup(CGROUP_PATH, pid) != 0) {
-        return 1;
+    return 0;
+}
+
+static int perf_open_all(perf_session *ps, int cgroup_fd, pid_t pid) {
+    ps->hardware = 1;
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+        perf_counter *pc = &ps->counters[i];
+        if (pc->type == PERF_TYPE_HARDWARE && !ps->hardware)
+            continue;
+        if (perf_open_counter(ps, pc, cgroup_fd, pid) == 0)
+            continue;
+        if (pc->type == PERF_TYPE_HARDWARE) {
+            // No PMU or access restricted: software counters only
+            ps->hardware = 0;
+            for (int j = 0; j < i; j++)
+                perf_close_counter(ps, &ps->counters[j]);
+            continue;
+        }
+        return -1;
     }
+    return 0;
+}
 
-    close(pipefd[0]);
+int perf_start(perf_session *ps, const char *cgroup_path, pid_t pid) {
+    memset(ps, 0, sizeof(*ps));
+    memcpy(ps->counters, perf_counter_defs, sizeof(perf_counter_defs));
+    ps->ncpus = sysconf(_SC_NPROCESSORS_CONF);
+    if (ps->ncpus < 1)
+        ps->ncpus = 1;
 
-    if (write(pipefd[1], "1", 1) != 1) {
-        perror("write");
-        return 1;
+    int cgroup_fd = open(cgroup_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (cgroup_fd != -1) {
+        ps->cgroup_mode = 1;
+        int ret = perf_open_all(ps, cgroup_fd, pid);
+        close(cgroup_fd);
+        if (ret == 0)
+            goto enable;
+        for (int i = 0; i < PERF_COUNTER_COUNT; i++)
+            perf_close_counter(ps, &ps->counters[i]);
     }
-    close(pipefd[1]);
 
-    // Wait for the child process to finish
-    int status;
-    if (waitpid(pid, &status, 0) == -1) {
-        perror("waitpid");
-        free(stack);
-        free(cmd_args);
-        return EXIT_FAILURE;
+    ps->cgroup_mode = 0;
+    if (perf_open_all(ps, -1, pid) != 0) {
+        perror("perf_event_open");
+        for (int i = 0; i < PERF_COUNTER_COUNT; i++)
+            perf_close_counter(ps, &ps->counters[i]);
+        return -1;
     }
 
-    // Unmount /proc and remove the directory after the child process finishes
-    char proc_path[1024];
-    if (snprintf(proc_path, sizeof(proc_path), "%s/proc", temp_dir) >= sizeof(proc_path)) {
-        fprintf(stderr, "proc path too long\n");
-        free(stack);
-        free(cmd_args);
-        return EXIT_FAILURE;
+enable:
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+        perf_counter *pc = &ps->counters[i];
+        for (int cpu = 0; pc->fds && cpu < ps->ncpus; cpu++)
+            if (pc->fds[cpu] >= 0)
+                ioctl(pc->fds[cpu], PERF_EVENT_IOC_ENABLE, 0);
     }
+    fprintf(stderr, "perf: counting %s%s\n",
+            ps->cgroup_mode ? "cgroup " : "process tree ",
+            ps->hardware ? "(hardware + software)" : "(software only, PMU unavailable)");
+    return 0;
+}
 
-    if (umount(proc_path) == -1) {
-        perror("umount /proc");
+static void perf_read(perf_session *ps) {
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+        perf_counter *pc = &ps->counters[i];
+        if (!pc->fds)
+            continue;
+        uint64_t total = 0;
+        for (int cpu = 0; cpu < ps->ncpus; cpu++) {
+            uint64_t buf[3];
+            if (pc->fds[cpu] < 0 || read(pc->fds[cpu], buf, sizeof(buf)) != sizeof(buf))
+                continue;
+            // Scale for multiplexing when more events than PMU slots
+            if (buf[2] == 0)
+                continue;
+            if (buf[2] < buf[1])
+                total += (uint64_t) ((double) buf[0] * buf[1] / buf[2]);
+            else
+                total += buf[0];
+        }
+        pc->last = pc->value;
+        pc->value = total;
     }
+}
 
-    // Remove temporary directory recursively
-    char remove_cmd[1024];
-    if (snprintf(remove_cmd, sizeof(remove_cmd), "rm -rf %s", temp_dir) >= sizeof(remove_cmd)) {
-        fprintf(stderr, "remove command too long\n");
-        free(stack);
-        free(cmd_args);
-        return EXIT_FAILURE;
+static double perf_ratio(uint64_t num, uint64_t den) {
+    return den ? (double) num / den : 0.0;
+}
+
+// Prints the counters accumulated since the previous report, or totals when
+// delta is 0.
+void perf_report(perf_session *ps, int delta) {
+    uint64_t v[PERF_COUNTER_COUNT];
+    perf_read(ps);
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++)
+        v[i] = ps->counters[i].value - (delta ? ps->counters[i].last : 0);
+
+    fprintf(stderr, "perf: %s task-clock %.1f ms, context-switches %" PRIu64 ", page-faults %" PRIu64 "\n",
+            delta ? "interval" : "total",
+            v[PERF_TASK_CLOCK] / 1e6, v[PERF_CONTEXT_SWITCHES], v[PERF_PAGE_FAULTS]);
+    if (!ps->hardware)
+        return;
+    fprintf(stderr, "perf: cycles %" PRIu64 ", instructions %" PRIu64 ", IPC %.2f\n",
+            v[PERF_CYCLES], v[PERF_INSTRUCTIONS], perf_ratio(v[PERF_INSTRUCTIONS], v[PERF_CYCLES]));
+    fprintf(stderr, "perf: cache-misses %" PRIu64 " (%.2f%% of refs, %.2f MPKI), branch-misses %" PRIu64 " (%.2f%% of branches)\n",
+            v[PERF_CACHE_MISSES], 100.0 * perf_ratio(v[PERF_CACHE_MISSES], v[PERF_CACHE_REFS]),
+            1000.0 * perf_ratio(v[PERF_CACHE_MISSES], v[PERF_INSTRUCTIONS]),
+            v[PERF_BRANCH_MISSES], 100.0 * perf_ratio(v[PERF_BRANCH_MISSES], v[PERF_BRANCHES]));
+}
+
+void perf_stop(perf_session *ps) {
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++)
+        perf_close_counter(ps, &ps->counters[i]);
+}
+
+// Controllers the per-container leaf cgroups need from mycgroup. Missing
+// ones (no hugetlb pages configured, v1 hosts) are skipped. They stay
+// enabled, so a supervisor only enables them for its first container.
+static const char * cgroup_controllers[] = { "+cpu", "+memory", "+pids", "+hugetlb", "+cpuset" };
+
+int create_container_cgroup(char *cgroup_path, size_t size, const char *id) {
+    static int controllers_enabled;
+    if (!controllers_enabled) {
+        if (kops->mkdir(CGROUP_PATH, 0755) != 0 && errno != EEXIST) {
+            perror("mkdir");
+            return -1;
+        }
+        for (size_t i = 0; i < sizeof(cgroup_controllers) / sizeof(cgroup_controllers[0]); i++) {
+            char filepath[256];
+            snprintf(filepath, sizeof(filepath), "%s/%s", CGROUP_PATH, CGROUP_SUBTREE_FILE);
+            if (kops->write_file(filepath, cgroup_controllers[i], strlen(cgroup_controllers[i])) == -1 && errno != ENOENT)
+                fprintf(stderr, "WARNING: enable %s: %s\n", cgroup_controllers[i] + 1, strerror(errno));
+        }
+        controllers_enabled = 1;
+    }
+    if (snprintf(cgroup_path, size, "%s/%s", CGROUP_PATH, id) >= size) {
+        fprintf(stderr, "cgroup path too long\n");
+        return -1;
     }
+    return create_cgroup(cgroup_path);
+}
 
-    if (system(remove_cmd) == -1) {
-        perror("rm -rf temp_dir");
+void remove_container_cgroup(const char *cgroup_path) {
+    // The pid namespace is torn down asynchronously after init exits, so
+    // the cgroup can stay populated for a moment
+    for (int i = 0; i < 100; i++) {
+        if (kops->rmdir(cgroup_path) == 0 || errno == ENOENT)
+            return;
+        if (errno != EBUSY)
+            break;
+        usleep(1000);
     }
+    perror("rmdir cgroup");
+}
 
+static const memory_profile memory_profiles[] = {
+    // The historical 10 MB cap
+    { "default", "10000000", NULL, NULL, NULL, NULL, THP_DEFAULT, 0, NULL },
+    // Protected from reclaim, never swapped, no THP compaction stalls
+    { "latency", "1G", "512M", "256M", "0", "max", THP_NEVER, 0, NULL },
+    // No protection, swap allowed, THP left to the system setting, shrunk when idle
+    { "batch", "4G", "0", "0", "max", "0", THP_DEFAULT, 5000, "64M" },
+};
 
-    free(stack);
-    free(cmd_args);
+const memory_profile * find_memory_profile(const char *name) {
+    for (size_t i = 0; i < sizeof(memory_profiles) / sizeof(memory_profiles[0]); i++)
+        if (strcmp(memory_profiles[i].name, name) == 0)
+            return &memory_profiles[i];
+    return NULL;
+}
 
-    // Return the exit status of the child process
-    if (WIFEXITED(status)) {
-        return WEXITSTATUS(status);
-    } else {
-        return EXIT_FAILURE;
+static int set_hugetlb_limits(const char *cgroup_path, const char *value) {
+    DIR *d = opendir(cgroup_path);
+    if (!d) {
+        perror("opendir cgroup");
+        return -1;
     }
+    struct dirent *dir;
+    int ret = 0;
+    while ((dir = readdir(d)) != NULL) {
+        // hugetlb.2MB.max, hugetlb.1GB.max, but not hugetlb.2MB.rsvd.max
+        size_t len = strlen(dir->d_name);
+        if (strncmp(dir->d_name, "hugetlb.", 8) != 0 || len < 4 || strcmp(dir->d_name + len - 4, ".max") != 0)
+            continue;
+        if (strstr(dir->d_name, ".rsvd."))
+            continue;
+        if (set_cgroup_value(cgroup_path, dir->d_name, value) != 0)
+            ret = -1;
+    }
+    closedir(d);
+    return ret;
+}
+
+int apply_memory_profile(const char *cgroup_path, const memory_profile *mp) {
+    struct {
+        const char * file;
+        const char * value;
+        int optional;       // swap accounting can be disabled at boot
+    } settings[] = {
+        { CGROUP_MEMORY_FILE, mp->memory_max, 0 },
+        { CGROUP_MEMORY_LOW_FILE, mp->memory_low, 0 },
+        { CGROUP_MEMORY_MIN_FILE, mp->memory_min, 0 },
+        { CGROUP_SWAP_FILE, mp->swap_max, 1 },
+    };
+    for (size_t i = 0; i < sizeof(settings) / sizeof(settings[0]); i++) {
+        if (!settings[i].value)
+            continue;
+        if (settings[i].optional) {
+            char filepath[256];
+            snprintf(filepath, sizeof(filepath), "%s/%s", cgroup_path, settings[i].file);
+            if (!kops->exists(filepath)) {
+                fprintf(stderr, "WARNING: %s not available, skipped\n", settings[i].file);
+                continue;
+            }
+        }
+        if (set_cgroup_value(cgroup_path, settings[i].file, settings[i].value) != 0)
+            return -1;
+    }
+    if (mp->hugetlb_max && set_hugetlb_limits(cgroup_path, mp->hugetlb_max) != 0)
+        return -1;
+    return 0;
+}
+
+// The container's first process runs on the supervisor's memory until it
+// execs with --launch=vm, so it shares the supervisor's stdio locks. Its
+// errors before exec are formatted by hand into "mocker: <what> failed
+// (errno N)" and written with a single write(2) instead of perror/fprintf.
+static void child_error(const char *what) {
+    int err = errno;
+    char msg[256];
+    size_t len = 0;
+    const char *parts[] = { "mocker: ", what, " failed (errno " };
+    for (size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); i++)
+        for (const char *p = parts[i]; *p && len < sizeof(msg) - 16; p++)
+            msg[len++] = *p;
+    char digits[12];
+    int n = 0;
+    do {
+        digits[n++] = '0' + err % 10;
+        err /= 10;
+    } while (err > 0 && n < (int) sizeof(digits));
+    while (n > 0)
+        msg[len++] = digits[--n];
+    msg[len++] = ')';
+    msg[len++] = '\n';
+    ssize_t written = write(STDERR_FILENO, msg, len);
+    (void) written;
+}
+
+// Called in the child right before exec; the setting is inherited by exec
+// and by every process the workload forks.
+void apply_thp_policy(int thp) {
+    if (thp == THP_NEVER) {
+        if (prctl(PR_SET_THP_DISABLE, 1, 0, 0, 0) == -1)
+            child_error("prctl PR_SET_THP_DISABLE");
+    } else if (thp == THP_MADVISE) {
+        if (prctl(PR_SET_THP_DISABLE, 1, PR_THP_DISABLE_EXCEPT_ADVISED, 0, 0) == -1)
+            child_error("prctl PR_SET_THP_DISABLE madvise");
+    }
+}
+
+static uint64_t cgroup_cpu_usage(const char *cgroup_path) {
+    char filepath[256];
+    snprintf(filepath, sizeof(filepath), "%s/cpu.stat", cgroup_path);
+    char buf[1024];
+    ssize_t n = kops->read_file(filepath, buf, sizeof(buf) - 1);
+    if (n <= 0)
+        return 0;
+    buf[n] = '\0';
+    char *line = strstr(buf, "usage_usec ");
+    return line ? strtoull(line + 11, NULL, 10) : 0;
+}
+
+// Proactive reclaim: a container that used less than 1% of a cpu over the
+// last interval is considered idle and asked to give back memory.
+typedef struct reclaim_state {
+    uint64_t last_usage;
+} reclaim_state;
+
+void reclaim_if_idle(const char *cgroup_path, const memory_profile *mp, reclaim_state *rs) {
+    uint64_t usage = cgroup_cpu_usage(cgroup_path);
+    uint64_t busy = usage - rs->last_usage;
+    rs->last_usage = usage;
+    if (busy * 100 >= (uint64_t) mp->reclaim_interval_ms * 1000)
+        return;
+    char filepath[256];
+    snprintf(filepath, sizeof(filepath), "%s/%s", cgroup_path, CGROUP_RECLAIM_FILE);
+    // EAGAIN just means less than the full amount could be reclaimed
+    if (kops->write_file(filepath, mp->reclaim_amount, strlen(mp->reclaim_amount)) == -1 && errno != EAGAIN && errno != ENOENT)
+        perror("write memory.reclaim");
+}
+
+static long monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static double elapsed_ms(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+// Blocks for up to timeout_ms or until the child exits. A pidfd lets poll
+// wake up on exit; without one we fall back to short sleeps.
+static void wait_child_timeout(int pidfd, int timeout_ms) {
+    if (pidfd >= 0) {
+        struct pollfd pfd = { .fd = pidfd, .events = POLLIN };
+        poll(&pfd, 1, timeout_ms);
+    } else {
+        usleep((timeout_ms < 10 ? timeout_ms : 10) * 1000);
+    }
+}
+
+// Waits for the container while running the periodic jobs its options ask
+// for (perf intervals, idle reclaim).
+pid_t supervise(pid_t pid, int *status, const run_options *opts, const char *cgroup_path, perf_session *perf) {
+    int perf_ms = perf ? opts->perf_interval_ms : 0;
+    int reclaim_ms = opts->memory.reclaim_interval_ms;
+    if (perf_ms <= 0 && reclaim_ms <= 0)
+        return waitpid(pid, status, 0);
+
+    int pidfd = -1;
+#ifdef SYS_pidfd_open
+    pidfd = syscall(SYS_pidfd_open, pid, 0);
+#endif
+    reclaim_state rs = { cgroup_cpu_usage(cgroup_path) };
+    long now = monotonic_ms();
+    long next_perf = now + perf_ms;
+    long next_reclaim = now + reclaim_ms;
+
+    pid_t waited;
+    while ((waited = waitpid(pid, status, WNOHANG)) == 0) {
+        long next = LONG_MAX;
+        if (perf_ms > 0 && next_perf < next)
+            next = next_perf;
+        if (reclaim_ms > 0 && next_reclaim < next)
+            next = next_reclaim;
+        now = monotonic_ms();
+        if (next > now) {
+            wait_child_timeout(pidfd, next - now);
+            now = monotonic_ms();
+        }
+        if (perf_ms > 0 && now >= next_perf) {
+            perf_report(perf, 1);
+            next_perf += perf_ms;
+        }
+        if (reclaim_ms > 0 && now >= next_reclaim) {
+            reclaim_if_idle(cgroup_path, &opts->memory, &rs);
+            next_reclaim += reclaim_ms;
+        }
+    }
+    if (pidfd >= 0)
+        close(pidfd);
+    return waited;
+}
+
+static int update_map(char *mapping, char *map_file) {
+    size_t map_len;
+
+    map_len = strlen(mapping);
+    for (size_t j = 0; j < map_len; j++)
+        if (mapping[j] == ',')
+            mapping[j] = '\n';
+
+    if (kops->write_file(map_file, mapping, map_len) != map_len) {
+        fprintf(stderr, "ERROR: write %s: %s\n", map_file, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void proc_setgroups_write(pid_t child_pid, char *str) {
+    char setgroups_path[PATH_MAX];
+
+    snprintf(setgroups_path, PATH_MAX, "/proc/%jd/setgroups", (intmax_t) child_pid);
+
+    if (kops->write_file(setgroups_path, str, strlen(str)) == -1 && errno != ENOENT)
+        fprintf(stderr, "ERROR: write %s: %s\n", setgroups_path, strerror(errno));
+}
+
+// A pod is a holder process sitting in its own IPC, net and UTS namespaces.
+// Members join those namespaces with setns() before their clone(), so they
+// share SysV/POSIX IPC, loopback and hostname while keeping their own
+// user, mount and PID namespaces and cgroup.
+static const char * pod_namespaces[] = { "ipc", "net", "uts" };
+
+#define POD_NAMESPACE_COUNT (sizeof(pod_namespaces) / sizeof(pod_namespaces[0]))
+
+static int valid_name(const char *name) {
+    size_t len = strlen(name);
+    return len > 0 && len < 64 && !strchr(name, '/') && strcmp(name, ".") != 0 && strcmp(name, "..") != 0;
+}
+
+static int make_run_dir(const char *path) {
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+    if (mkdir_parents(dir) != 0 || (mkdir(dir, 0755) == -1 && errno != EEXIST)) {
+        fprintf(stderr, "mkdir -p %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Runs argv without a shell and waits for it. With out, its stdout is read
+// into out (at most size - 1 bytes, NUL terminated). Returns 0 when it
+// exits with status 0.
+static int run_argv(char *const argv[], char *out, size_t size) {
+    int pipefd[2] = { -1, -1 };
+    if (out && pipe2(pipefd, O_CLOEXEC) == -1)
+        return -1;
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (out && dup2(pipefd[1], STDOUT_FILENO) == -1)
+            _exit(127);
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    size_t len = 0;
+    if (out) {
+        close(pipefd[1]);
+        ssize_t n;
+        while (pid > 0 && len + 1 < size && (n = read(pipefd[0], out + len, size - 1 - len)) > 0)
+            len += n;
+        out[len] = '\0';
+        close(pipefd[0]);
+    }
+    int status;
+    if (pid == -1 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s failed\n", argv[0]);
+        return -1;
+    }
+    return 0;
+}
+
+static int bring_up_loopback(void) {
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, "lo", IFNAMSIZ - 1);
+    if (ioctl(fd, SIOCGIFFLAGS, &ifr) == -1) {
+        perror("SIOCGIFFLAGS lo");
+        close(fd);
+        return -1;
+    }
+    ifr.ifr_flags |= IFF_UP | IFF_RUNNING;
+    if (ioctl(fd, SIOCSIFFLAGS, &ifr) == -1) {
+        perror("SIOCSIFFLAGS lo");
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+typedef struct pod_args {
+    const char * name;
+    int * pipefd;
+} pod_args;
+
+static int pod_holder(void * args) {
+    pod_args * pa = (pod_args *) args;
+    close(pa->pipefd[0]);
+
+    if (sethostname(pa->name, strlen(pa->name)) == -1) {
+        perror("sethostname");
+        return EXIT_FAILURE;
+    }
+    if (bring_up_loopback() != 0) {
+        return EXIT_FAILURE;
+    }
+    prctl(PR_SET_NAME, POD_HOLDER_COMM, 0, 0, 0);
+    setsid();
+
+    // Tell `pod create` the namespaces are ready, then detach from its tty
+    if (write(pa->pipefd[1], "1", 1) != 1) {
+        return EXIT_FAILURE;
+    }
+    close(pa->pipefd[1]);
+    int devnull = open("/dev/null", O_RDWR);
+    if (devnull != -1) {
+        dup2(devnull, STDIN_FILENO);
+        dup2(devnull, STDOUT_FILENO);
+        dup2(devnull, STDERR_FILENO);
+        close(devnull);
+    }
+
+    for (;;)
+        pause();
+}
+
+// Returns the holder pid of a running pod, or -1 if it does not exist.
+pid_t pod_lookup(const char *name) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", POD_DIR, name);
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return -1;
+    intmax_t pid = -1;
+    if (fscanf(fp, "%jd", &pid) != 1)
+        pid = -1;
+    fclose(fp);
+    if (pid <= 0)
+        return -1;
+
+    // Guard against the pid having been reused by something else
+    char comm_path[64];
+    char comm[32] = "";
+    snprintf(comm_path, sizeof(comm_path), "/proc/%jd/comm", pid);
+    fp = fopen(comm_path, "r");
+    if (!fp)
+        return -1;
+    if (!fgets(comm, sizeof(comm), fp))
+        comm[0] = '\0';
+    fclose(fp);
+    comm[strcspn(comm, "\n")] = '\0';
+    if (strcmp(comm, POD_HOLDER_COMM) != 0)
+        return -1;
+    return (pid_t) pid;
+}
+
+// Moves the calling process into the pod's IPC, net and UTS namespaces.
+// Done in the supervisor because the child, once in its own user
+// namespace, no longer has privileges over the pod's namespaces.
+int pod_join(const char *name) {
+    pid_t holder = pod_lookup(name);
+    if (holder == -1) {
+        fprintf(stderr, "pod %s is not running\n", name);
+        return -1;
+    }
+    int fds[POD_NAMESPACE_COUNT];
+    for (size_t i = 0; i < POD_NAMESPACE_COUNT; i++) {
+        char ns_path[64];
+        snprintf(ns_path, sizeof(ns_path), "/proc/%jd/ns/%s", (intmax_t) holder, pod_namespaces[i]);
+        fds[i] = open(ns_path, O_RDONLY | O_CLOEXEC);
+        if (fds[i] == -1) {
+            fprintf(stderr, "ERROR: open %s: %s\n", ns_path, strerror(errno));
+            while (i-- > 0)
+                close(fds[i]);
+            return -1;
+        }
+    }
+    int ret = 0;
+    for (size_t i = 0; i < POD_NAMESPACE_COUNT; i++) {
+        if (ret == 0 && kops->setns(fds[i], 0) == -1) {
+            fprintf(stderr, "ERROR: setns %s: %s\n", pod_namespaces[i], strerror(errno));
+            ret = -1;
+        }
+        close(fds[i]);
+    }
+    return ret;
+}
+
+int pod_create(const char *name) {
+    if (pod_lookup(name) != -1) {
+        fprintf(stderr, "pod %s already exists\n", name);
+        return -1;
+    }
+    if (make_run_dir(POD_DIR) != 0) {
+        return -1;
+    }
+
+    char * stack = malloc(STACK_SIZE);
+    if (!stack) {
+        perror("malloc");
+        return -1;
+    }
+    int pipefd[2];
+    if (pipe(pipefd) != 0) {
+        perror("pipe");
+        free(stack);
+        return -1;
+    }
+    pod_args pa = { name, pipefd };
+    // No SIGCHLD: the holder outlives us and is reparented to init
+    pid_t pid = clone(pod_holder, stack + STACK_SIZE, CLONE_NEWIPC | CLONE_NEWNET | CLONE_NEWUTS, &pa);
+    if (pid == -1) {
+        perror("clone");
+        free(stack);
+        return -1;
+    }
+    close(pipefd[1]);
+    char buffer;
+    int ready = read(pipefd[0], &buffer, 1) == 1;
+    close(pipefd[0]);
+    free(stack);
+    if (!ready) {
+        fprintf(stderr, "pod %s failed to start\n", name);
+        return -1;
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", POD_DIR, name);
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        perror("fopen pod file");
+        kill(pid, SIGKILL);
+        return -1;
+    }
+    fprintf(fp, "%jd\n", (intmax_t) pid);
+    fclose(fp);
+    printf("created pod %s (holder pid %jd)\n", name, (intmax_t) pid);
+    return 0;
+}
+
+int pod_remove(const char *name) {
+    pid_t holder = pod_lookup(name);
+    if (holder != -1 && kill(holder, SIGKILL) == -1) {
+        perror("kill");
+        return -1;
+    }
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", POD_DIR, name);
+    if (unlink(path) == -1) {
+        if (errno == ENOENT)
+            fprintf(stderr, "pod %s does not exist\n", name);
+        else
+            perror("unlink pod file");
+        return -1;
+    }
+    return 0;
+}
+
+int pod_main(int argc, char ** args) {
+    if (argc != 4 || !valid_name(args[3])) {
+        fprintf(stderr, "Usage: %s pod create|rm <name>\n", args[0]);
+        return EXIT_FAILURE;
+    }
+    if (strcmp(args[2], "create") == 0)
+        return pod_create(args[3]) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    if (strcmp(args[2], "rm") == 0)
+        return pod_remove(args[3]) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    fprintf(stderr, "Usage: %s pod create|rm <name>\n", args[0]);
+    return EXIT_FAILURE;
+}
+
+// Built-in PID 1 for --init. Every signal is blocked and read from a
+// signalfd: SIGCHLD reaps whatever was reparented to us, the rest go to the
+// workload. Blocked signals are never discarded, which PID 1 would otherwise
+// do for signals left at their default action. The workload is started with
+// posix_spawn, which is vfork based, so nothing is copied even when this
+// process still shares the supervisor's memory (--launch=vm). Returns the
+// workload's exit status, or 128 + the signal that killed it.
+static int container_init(const char *command, char ** argv, char ** envp)
+{
+    sigset_t all, none;
+    sigfillset(&all);
+    sigemptyset(&none);
+    if (sigprocmask(SIG_BLOCK, &all, NULL) == -1) {
+        perror("sigprocmask");
+        return EXIT_FAILURE;
+    }
+    int sfd = signalfd(-1, &all, SFD_CLOEXEC);
+    if (sfd == -1) {
+        perror("signalfd");
+        return EXIT_FAILURE;
+    }
+
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &none);
+    posix_spawnattr_setsigdefault(&attr, &all);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+    pid_t workload;
+    int err = posix_spawnp(&workload, command, NULL, &attr, argv, envp);
+    posix_spawnattr_destroy(&attr);
+    if (err != 0) {
+        fprintf(stderr, "%s: %s\n", command, strerror(err));
+        return 127;
+    }
+
+    for (;;) {
+        struct signalfd_siginfo si;
+        if (read(sfd, &si, sizeof(si)) != sizeof(si)) {
+            if (errno == EINTR)
+                continue;
+            perror("read signalfd");
+            return EXIT_FAILURE;
+        }
+        if (si.ssi_signo != SIGCHLD) {
+            kill(workload, si.ssi_signo);
+            continue;
+        }
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            // Our exit takes down whatever is left in the namespace
+            if (pid == workload)
+                return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+        }
+    }
+}
+
+int run_command(void * args)
+{
+    child_args * ca = (child_args *) args;
+    const int * pipefd = ca->pipefd;
+    char ** cmd_args = ca->cmd_args;
+    char * temp_dir = cmd_args[0];
+    char * command = cmd_args[1];
+
+
+    // NOTE: Needed if calling clone with CLONE_NEWNS?
+    // Unshare the mount namespace to isolate it from the host
+    if (kops->unshare(CLONE_NEWNS) == -1) {
+        child_error("unshare");
+        return EXIT_FAILURE;
+    }
+
+
+    // Requests arrive through the ring, and the supervisor owns stdin.
+    // /dev/null has to be opened before the chroot hides it.
+    int devnull = -1;
+    if (ca->ring_fd >= 0) {
+        devnull = open("/dev/null", O_RDONLY);
+    }
+
+    char * namespace = "new_namespace";
+    if (!ca->in_pod && sethostname(namespace, strlen(namespace)) == -1)
+    {
+        child_error("sethostname");
+        return EXIT_FAILURE;
+    }
+
+    // Change root directory to the temporary directory
+    if (chroot(temp_dir) == -1)
+    {
+        child_error("chroot");
+        return EXIT_FAILURE;
+    }
+
+    // Change working directory to root
+    if (chdir("/") == -1)
+    {
+        child_error("chdir");
+        return EXIT_FAILURE;
+    }
+
+    // Mount /proc
+    if (kops->mount("proc", "/proc", "proc", 0, NULL) == -1) {
+        child_error("mount /proc");
+        return EXIT_FAILURE;
+    }
+
+
+    close(pipefd[1]);
+
+    char buffer;
+    if (read(pipefd[0], &buffer, 1) != 1) {
+        child_error("read");
+        return 1;
+    }
+    close(pipefd[0]);
+
+    apply_thp_policy(ca->thp);
+
+    if (devnull >= 0) {
+        dup2(devnull, STDIN_FILENO);
+        close(devnull);
+    }
+
+    if (ca->init)
+        return container_init(command, &cmd_args[1], ca->envp);
+
+    execvpe(command, &cmd_args[1], ca->envp);
+    child_error("execvp");
+
+    // This code will only be reached if execvp fails
+    // Unmount /proc before exiting
+    if (kops->umount("/proc") == -1) {
+        child_error("umount /proc");
+    }
+    rmdir("/proc");
+
+    return EXIT_FAILURE;
+}
+
+// Boot traces: `--record-boot` watches which files in the root the workload
+// opens during its first milliseconds (fanotify on the root's filesystem,
+// which reaches into the child's mount namespace) and records, for each,
+// the host file the root's copy was made from. The root itself is never
+// cold: it was written moments earlier. The cold reads are those of the
+// host files while the root is being built, so later runs of the same
+// command issue posix_fadvise(WILLNEED) on those sources before the root
+// is built, and on the root's copies once it is (which only helps copies
+// that share extents with their source and so start out uncached).
+#define BOOT_MAX_FILES 4096
+// One "root path\thost source\n" line per file, the source empty if the
+// file was not copied from the host
+#define BOOT_TRACE_HEADER "# mocker boot trace v2\n"
+
+// FNV-1a over the command line
+static uint64_t boot_trace_key(char ** cmd, int cmd_count) {
+    uint64_t h = 1469598103934665603ULL;
+    for (int i = 0; i < cmd_count; i++) {
+        for (const char *p = cmd[i]; ; p++) {
+            h ^= (unsigned char) *p;
+            h *= 1099511628211ULL;
+            if (!*p)
+                break;
+        }
+    }
+    return h;
+}
+
+static void boot_trace_path(char *path, size_t size, char ** cmd, int cmd_count) {
+    snprintf(path, size, "%s/%016" PRIx64 ".trace", BOOT_TRACE_DIR, boot_trace_key(cmd, cmd_count));
+}
+
+int boot_record_start(const char *root) {
+    int fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK, O_RDONLY | O_LARGEFILE | O_CLOEXEC);
+    if (fd == -1) {
+        perror("fanotify_init");
+        return -1;
+    }
+    if (fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, FAN_OPEN | FAN_OPEN_EXEC, AT_FDCWD, root) == -1) {
+        perror("fanotify_mark");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Collects open events for window_ms or until the workload exits, then
+// writes the trace for this command.
+int boot_record_finish(const char *root, const char *auto_deps, pid_t pid, int fan_fd, int window_ms,
+                       char ** cmd, int cmd_count) {
+    path_list files = {0};
+    size_t root_len = strlen(root);
+    int pidfd = -1;
+#ifdef SYS_pidfd_open
+    pidfd = syscall(SYS_pidfd_open, pid, 0);
+#endif
+    long deadline = monotonic_ms() + window_ms;
+    int done = 0;
+    while (!done) {
+        long left = deadline - monotonic_ms();
+        if (left <= 0)
+            break;
+        struct pollfd pfd[2] = { { .fd = fan_fd, .events = POLLIN }, { .fd = pidfd, .events = POLLIN } };
+        if (poll(pfd, pidfd >= 0 ? 2 : 1, left) <= 0)
+            continue;
+        // The workload exited: read what is queued, then stop
+        if (pidfd >= 0 && (pfd[1].revents & POLLIN))
+            done = 1;
+
+        char buf[8192];
+        ssize_t len;
+        while ((len = read(fan_fd, buf, sizeof(buf))) > 0) {
+            struct fanotify_event_metadata *ev = (struct fanotify_event_metadata *) buf;
+            for (; FAN_EVENT_OK(ev, len); ev = FAN_EVENT_NEXT(ev, len)) {
+                if (ev->fd < 0)
+                    continue;
+                char link[64], target[PATH_MAX];
+                snprintf(link, sizeof(link), "/proc/self/fd/%d", ev->fd);
+                ssize_t n = readlink(link, target, sizeof(target) - 1);
+                close(ev->fd);
+                if (n <= 0)
+                    continue;
+                target[n] = '\0';
+                // Same filesystem, other processes: keep only our root
+                if (strncmp(target, root, root_len) != 0 || target[root_len] != '/')
+                    continue;
+                if (strpbrk(target, "\t\n") || files.count >= BOOT_MAX_FILES)
+                    continue;
+                path_list_add(&files, target + root_len);
+            }
+        }
+    }
+    if (pidfd >= 0)
+        close(pidfd);
+    close(fan_fd);
+
+    char path[PATH_MAX];
+    boot_trace_path(path, sizeof(path), cmd, cmd_count);
+    int ret = -1;
+    if (make_run_dir(BOOT_TRACE_DIR) == 0) {
+        char tmp[PATH_MAX + 8];
+        snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+        FILE *out = fopen(tmp, "w");
+        if (!out) {
+            perror("fopen boot trace");
+        } else {
+            path_list closure = {0};
+            if (auto_deps && elf_closure(auto_deps, &closure) != 0)
+                path_list_free(&closure);
+            fprintf(out, BOOT_TRACE_HEADER);
+            for (size_t i = 0; i < files.count; i++) {
+                char src[PATH_MAX];
+                if (root_source(&closure, files.paths[i], src) != 0 || strpbrk(src, "\t\n"))
+                    src[0] = '\0';
+                fprintf(out, "%s\t%s\n", files.paths[i], src);
+            }
+            path_list_free(&closure);
+            if (fclose(out) == 0 && rename(tmp, path) == 0) {
+                ret = 0;
+                if (!quiet)
+                    printf("Recorded boot trace of %zu files: %s\n", files.count, path);
+            } else {
+                perror("write boot trace");
+                unlink(tmp);
+            }
+        }
+    }
+    path_list_free(&files);
+    return ret;
+}
+
+// Starts asynchronous readahead of every file in the command's trace: with
+// root NULL of the host sources, before the root is copied from them,
+// otherwise of the copies in root. WILLNEED only queues the I/O, so one
+// pass over the trace already has all reads in flight in parallel.
+void boot_prefetch(const char *root, char ** cmd, int cmd_count) {
+    char path[PATH_MAX];
+    boot_trace_path(path, sizeof(path), cmd, cmd_count);
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return;
+
+    char line[2 * PATH_MAX + 2];
+    // Traces of older layouts are ignored until they are recorded again
+    if (!fgets(line, sizeof(line), fp) || strcmp(line, BOOT_TRACE_HEADER) != 0) {
+        fclose(fp);
+        return;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        char *tab = strchr(line, '\t');
+        if (!tab)
+            continue;
+        *tab = '\0';
+        char *src = tab + 1;
+        src[strcspn(src, "\n")] = '\0';
+        char file[PATH_MAX];
+        if (root) {
+            if (snprintf(file, sizeof(file), "%s%s", root, line) >= sizeof(file))
+                continue;
+        } else if (src[0]) {
+            snprintf(file, sizeof(file), "%s", src);
+        } else {
+            continue;
+        }
+        int fd = open(file, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+            close(fd);
+        }
+    }
+    fclose(fp);
+}
+
+// Snapshots. Right after a root is built, a manifest of every entry
+// (inode, mode, size, mtime, link target) is written next to the
+// container's state. `mocker commit` walks the live root, compares it to
+// the manifest and packs only the differences into a layer tar, named by
+// its sha256. Deleted paths become ".wh.<name>" whiteouts and a directory
+// that was removed and recreated gets a ".wh..wh..opq" marker, the same
+// convention as OCI layers. An image is a list of layer digests;
+// `mocker run --image` applies them on top of the root in order.
+#define WHITEOUT_PREFIX ".wh."
+#define WHITEOUT_OPAQUE ".wh..wh..opq"
+
+typedef struct manifest_entry {
+    char * path;            // relative to the root, "/bin/sh"
+    ino_t ino;
+    mode_t mode;
+    off_t size;
+    struct timespec mtime;
+    char * link;            // symlink target, NULL otherwise
+    int seen;
+} manifest_entry;
+
+typedef struct manifest {
+    manifest_entry * entries;
+    size_t count;
+    size_t cap;
+} manifest;
+
+static int manifest_cmp(const void *a, const void *b) {
+    return strcmp(((const manifest_entry *) a)->path, ((const manifest_entry *) b)->path);
+}
+
+static void manifest_free(manifest *mf) {
+    for (size_t i = 0; i < mf->count; i++) {
+        free(mf->entries[i].path);
+        free(mf->entries[i].link);
+    }
+    free(mf->entries);
+    memset(mf, 0, sizeof(*mf));
+}
+
+// nftw() has no user pointer, so the walk state is file static
+static manifest * walk_manifest;
+static size_t walk_root_len;
+
+static int manifest_visit(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void) type;
+    if (ftw->level == 0)
+        return 0;
+    if (strpbrk(path + walk_root_len, "\t\n"))
+        return 0;
+    manifest *mf = walk_manifest;
+    if (mf->count == mf->cap) {
+        size_t cap = mf->cap ? mf->cap * 2 : 256;
+        manifest_entry *entries = realloc(mf->entries, sizeof(manifest_entry) * cap);
+        if (!entries)
+            return -1;
+        mf->entries = entries;
+        mf->cap = cap;
+    }
+    manifest_entry *e = &mf->entries[mf->count];
+    memset(e, 0, sizeof(*e));
+    e->path = strdup(path + walk_root_len);
+    e->ino = st->st_ino;
+    e->mode = st->st_mode;
+    e->size = st->st_size;
+    e->mtime = st->st_mtim;
+    if (S_ISLNK(st->st_mode)) {
+        char target[PATH_MAX];
+        ssize_t n = readlink(path, target, sizeof(target) - 1);
+        target[n > 0 ? n : 0] = '\0';
+        e->link = strdup(target);
+    }
+    if (!e->path)
+        return -1;
+    mf->count++;
+    return 0;
+}
+
+// Walks root without following symlinks or crossing into mounts (the
+// container's /proc).
+int manifest_scan(const char *root, manifest *mf) {
+    memset(mf, 0, sizeof(*mf));
+    walk_manifest = mf;
+    walk_root_len = strlen(root);
+    if (nftw(root, manifest_visit, 64, FTW_PHYS | FTW_MOUNT) != 0) {
+        perror("nftw");
+        manifest_free(mf);
+        return -1;
+    }
+    qsort(mf->entries, mf->count, sizeof(manifest_entry), manifest_cmp);
+    return 0;
+}
+
+int manifest_save(const manifest *mf, const char *path) {
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        perror("fopen manifest");
+        return -1;
+    }
+    for (size_t i = 0; i < mf->count; i++) {
+        const manifest_entry *e = &mf->entries[i];
+        fprintf(fp, "%ju\t%o\t%jd\t%jd.%09ld\t%s\t%s\n", (uintmax_t) e->ino, e->mode, (intmax_t) e->size,
+                (intmax_t) e->mtime.tv_sec, e->mtime.tv_nsec, e->path, e->link ? e->link : "");
+    }
+    if (fclose(fp) != 0) {
+        perror("write manifest");
+        return -1;
+    }
+    return 0;
+}
+
+int manifest_load(const char *path, manifest *mf) {
+    memset(mf, 0, sizeof(*mf));
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        perror("fopen manifest");
+        return -1;
+    }
+    char line[2 * PATH_MAX + 128];
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\n")] = '\0';
+        uintmax_t ino;
+        unsigned int mode;
+        intmax_t size, sec;
+        long nsec;
+        int consumed = 0;
+        if (sscanf(line, "%ju\t%o\t%jd\t%jd.%ld\t%n", &ino, &mode, &size, &sec, &nsec, &consumed) != 5 || !consumed)
+            continue;
+        char *rel = line + consumed;
+        char *link = strchr(rel, '\t');
+        if (!link)
+            continue;
+        *link++ = '\0';
+        if (mf->count == mf->cap) {
+            size_t cap = mf->cap ? mf->cap * 2 : 256;
+            manifest_entry *entries = realloc(mf->entries, sizeof(manifest_entry) * cap);
+            if (!entries)
+                break;
+            mf->entries = entries;
+            mf->cap = cap;
+        }
+        manifest_entry *e = &mf->entries[mf->count++];
+        memset(e, 0, sizeof(*e));
+        e->path = strdup(rel);
+        e->ino = ino;
+        e->mode = mode;
+        e->size = size;
+        e->mtime.tv_sec = sec;
+        e->mtime.tv_nsec = nsec;
+        e->link = S_ISLNK(mode) ? strdup(link) : NULL;
+    }
+    fclose(fp);
+    qsort(mf->entries, mf->count, sizeof(manifest_entry), manifest_cmp);
+    return 0;
+}
+
+static manifest_entry *manifest_find(manifest *mf, const char *rel) {
+    manifest_entry key = { .path = (char *) rel };
+    return bsearch(&key, mf->entries, mf->count, sizeof(manifest_entry), manifest_cmp);
+}
+
+static int remove_visit(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void) st;
+    (void) ftw;
+    return type == FTW_DP ? rmdir(path) : unlink(path);
+}
+
+// rm -rf without a shell
+int remove_tree(const char *path) {
+    struct stat st;
+    if (lstat(path, &st) == -1)
+        return errno == ENOENT ? 0 : -1;
+    if (!S_ISDIR(st.st_mode))
+        return unlink(path);
+    return nftw(path, remove_visit, 64, FTW_DEPTH | FTW_PHYS | FTW_MOUNT);
+}
+
+// rm -rf of dir_fd/name. Nothing is followed, so a symlink in the tree
+// cannot lead the removal anywhere else.
+static int remove_tree_at(int dir_fd, const char *name) {
+    struct stat st;
+    if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+        return errno == ENOENT ? 0 : -1;
+    if (!S_ISDIR(st.st_mode))
+        return unlinkat(dir_fd, name, 0);
+    int fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    DIR *d = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!d) {
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    int ret = 0;
+    struct dirent *dir;
+    while (ret == 0 && (dir = readdir(d)) != NULL) {
+        if (strcmp(dir->d_name, ".") != 0 && strcmp(dir->d_name, "..") != 0)
+            ret = remove_tree_at(dirfd(d), dir->d_name);
+    }
+    closedir(d);
+    return ret == 0 ? unlinkat(dir_fd, name, AT_REMOVEDIR) : -1;
+}
+
+// Copies src_dir/name over dst_dir/name like `cp -a`, keeping mode, owner
+// and times. Nothing is followed on either side: an entry in the way is
+// replaced, unless both are directories, which are merged.
+static int copy_tree_at(int src_dir, int dst_dir, const char *name) {
+    struct stat st, old;
+    if (fstatat(src_dir, name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+        return -1;
+    if (fstatat(dst_dir, name, &old, AT_SYMLINK_NOFOLLOW) == 0 && !(S_ISDIR(st.st_mode) && S_ISDIR(old.st_mode)) &&
+        remove_tree_at(dst_dir, name) != 0)
+        return -1;
+    struct timespec times[2] = { st.st_atim, st.st_mtim };
+
+    if (S_ISLNK(st.st_mode)) {
+        char target[PATH_MAX];
+        ssize_t n = readlinkat(src_dir, name, target, sizeof(target) - 1);
+        if (n < 0)
+            return -1;
+        target[n] = '\0';
+        if (symlinkat(target, dst_dir, name) == -1 || fchownat(dst_dir, name, st.st_uid, st.st_gid, AT_SYMLINK_NOFOLLOW) == -1)
+            return -1;
+        return utimensat(dst_dir, name, times, AT_SYMLINK_NOFOLLOW);
+    }
+
+    int in = -1, out = -1, ret = -1;
+    if (S_ISDIR(st.st_mode)) {
+        if (mkdirat(dst_dir, name, 0700) == -1 && errno != EEXIST)
+            return -1;
+        in = openat(src_dir, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        out = openat(dst_dir, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        DIR *d = in >= 0 && out >= 0 ? fdopendir(in) : NULL;
+        if (d) {
+            in = -1;    // closed with d
+            ret = 0;
+            struct dirent *dir;
+            while (ret == 0 && (dir = readdir(d)) != NULL) {
+                if (strcmp(dir->d_name, ".") != 0 && strcmp(dir->d_name, "..") != 0)
+                    ret = copy_tree_at(dirfd(d), out, dir->d_name);
+            }
+            closedir(d);
+        }
+    } else if (S_ISREG(st.st_mode)) {
+        in = openat(src_dir, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        out = in >= 0 ? openat(dst_dir, name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600) : -1;
+        ret = out >= 0 && copy_fd(in, out, st.st_size) >= 0 ? 0 : -1;
+    } else {
+        return 0;   // devices, fifos and sockets are not part of layers
+    }
+    // Owner before mode, since chown clears the set-id bits
+    if (ret == 0 && (fchown(out, st.st_uid, st.st_gid) == -1 || fchmod(out, st.st_mode & 07777) == -1 ||
+                     futimens(out, times) == -1))
+        ret = -1;
+    if (in >= 0)
+        close(in);
+    if (out >= 0)
+        close(out);
+    return ret;
+}
+
+static void container_state_path(char *path, size_t size, const char *name, const char *suffix) {
+    snprintf(path, size, "%s/%s.%s", CONTAINER_DIR, name, suffix);
+}
+
+// Records the freshly built root (and the image it came from) so a later
+// commit can tell what the container changed.
+int snapshot_baseline(const char *root, const char *name, const char *image) {
+    if (make_run_dir(CONTAINER_DIR) != 0)
+        return -1;
+    manifest mf;
+    if (manifest_scan(root, &mf) != 0)
+        return -1;
+    char path[PATH_MAX];
+    container_state_path(path, sizeof(path), name, "manifest");
+    int ret = manifest_save(&mf, path);
+    manifest_free(&mf);
+    container_state_path(path, sizeof(path), name, "image");
+    if (ret == 0 && image) {
+        FILE *fp = fopen(path, "w");
+        if (!fp || fprintf(fp, "%s\n", image) < 0) {
+            perror("write image name");
+            ret = -1;
+        }
+        if (fp)
+            fclose(fp);
+    }
+    return ret;
+}
+
+void snapshot_forget(const char *name) {
+    char path[PATH_MAX];
+    container_state_path(path, sizeof(path), name, "manifest");
+    unlink(path);
+    container_state_path(path, sizeof(path), name, "image");
+    unlink(path);
+}
+
+static int entry_changed(const manifest_entry *old, const struct stat *st, const char *link) {
+    if (old->ino != st->st_ino || old->mode != st->st_mode)
+        return 1;
+    if (S_ISDIR(st->st_mode))
+        return 0;       // a directory's mtime only says its entries changed
+    if (S_ISLNK(st->st_mode))
+        return strcmp(old->link ? old->link : "", link) != 0;
+    return old->size != st->st_size || old->mtime.tv_sec != st->st_mtim.tv_sec ||
+           old->mtime.tv_nsec != st->st_mtim.tv_nsec;
+}
+
+// Entries of a live root are opened relative to it. The container can
+// swap any path for a symlink while it is being committed, so nothing may
+// be followed on the way to an entry.
+#define COMMIT_RESOLVE (RESOLVE_IN_ROOT | RESOLVE_NO_SYMLINKS | RESOLVE_NO_MAGICLINKS)
+
+// Copies one changed entry of the live root into the layer staging dir.
+// What is copied is what the opened fd refers to, not what the walk saw.
+static int stage_entry(int root_fd, const char *staging, const char *rel) {
+    char dst[PATH_MAX];
+    if (snprintf(dst, sizeof(dst), "%s%s", staging, rel) >= sizeof(dst)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    int fd = open_in_root(root_fd, rel, O_PATH | O_NOFOLLOW, 0, COMMIT_RESOLVE);
+    if (fd == -1)
+        return errno == ENOENT ? 0 : -1;    // removed since the walk saw it
+    struct stat st;
+    int ret = fstat(fd, &st);
+    if (ret == 0)
+        ret = mkdir_parents(dst);
+    // The staged copy keeps the entry's owner and mode for tar to record.
+    // Owner before mode, since chown clears the set-id bits.
+    if (ret == 0 && S_ISDIR(st.st_mode)) {
+        if (mkdir(dst, 0700) == -1 && errno != EEXIST)
+            ret = -1;
+        else if (chown(dst, st.st_uid, st.st_gid) == -1 || chmod(dst, st.st_mode & 07777) == -1)
+            ret = -1;
+    } else if (ret == 0 && S_ISLNK(st.st_mode)) {
+        char target[PATH_MAX];
+        ssize_t n = readlinkat(fd, "", target, sizeof(target) - 1);
+        if (n < 0) {
+            ret = -1;
+        } else {
+            target[n] = '\0';
+            if (symlink(target, dst) == -1 || lchown(dst, st.st_uid, st.st_gid) == -1)
+                ret = -1;
+        }
+    } else if (ret == 0 && S_ISREG(st.st_mode)) {
+        int in = open_in_root(root_fd, rel, O_RDONLY | O_NOFOLLOW | O_NONBLOCK, 0, COMMIT_RESOLVE);
+        int out = -1;
+        if (in == -1 || fstat(in, &st) == -1 || !S_ISREG(st.st_mode)) {
+            if (in != -1)
+                errno = EAGAIN;     // replaced between the two opens
+            ret = -1;
+        } else if ((out = open(dst, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) == -1 ||
+                   copy_fd(in, out, st.st_size) < 0 || fchown(out, st.st_uid, st.st_gid) == -1 ||
+                   fchmod(out, st.st_mode & 07777) == -1) {
+            ret = -1;
+        }
+        if (in != -1)
+            close(in);
+        if (out != -1 && close(out) == -1)
+            ret = -1;
+    }
+    // devices, fifos and sockets are not captured
+    close(fd);
+    return ret;
+}
+
+static int stage_marker(const char *staging, const char *rel_dir, const char *name) {
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s%s/%s", staging, rel_dir, name) >= sizeof(path))
+        return -1;
+    if (mkdir_parents(path) == -1)
+        return -1;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1)
+        return -1;
+    close(fd);
+    return 0;
+}
+
+typedef struct layer_walk {
+    int root_fd;
+    const char * staging;
+    int failed;
+} layer_walk;
+
+static layer_walk * walk_layer;
+
+// Applies whiteouts and opaque markers to the root, then drops them from
+// the staging dir so the remaining tree can be copied over as is. Names
+// come from the layer, so the directory holding the target is resolved
+// inside the root without following any symlink.
+static int whiteout_visit(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void) st;
+    (void) type;
+    layer_walk *lw = walk_layer;
+    const char *base = path + ftw->base;
+    if (strncmp(base, WHITEOUT_PREFIX, strlen(WHITEOUT_PREFIX)) != 0)
+        return 0;
+    char dir_path[PATH_MAX];
+    const char *rel = path + strlen(lw->staging);
+    int dir_len = base - rel - 1;
+    snprintf(dir_path, sizeof(dir_path), "%.*s", dir_len > 0 ? dir_len : 1, dir_len > 0 ? rel : "/");
+    int dir_fd = open_in_root(lw->root_fd, dir_path, O_RDONLY | O_DIRECTORY, 0,
+                              RESOLVE_IN_ROOT | RESOLVE_NO_SYMLINKS | RESOLVE_NO_MAGICLINKS);
+    if (dir_fd == -1) {
+        if (errno != ENOENT)    // nothing to hide
+            lw->failed = 1;
+    } else if (strcmp(base, WHITEOUT_OPAQUE) == 0) {
+        DIR *d = fdopendir(dir_fd);
+        struct dirent *dir;
+        while (d && (dir = readdir(d)) != NULL) {
+            if (strcmp(dir->d_name, ".") != 0 && strcmp(dir->d_name, "..") != 0 && remove_tree_at(dirfd(d), dir->d_name) != 0)
+                lw->failed = 1;
+        }
+        if (d)
+            closedir(d);
+        else
+            close(dir_fd);
+    } else {
+        const char *name = base + strlen(WHITEOUT_PREFIX);
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+            lw->failed = 1;
+        else if (name[0] && remove_tree_at(dir_fd, name) != 0)
+            lw->failed = 1;
+        close(dir_fd);
+    }
+    if (lw->failed)
+        fprintf(stderr, "ERROR: whiteout %s: %s\n", rel, strerror(errno));
+    unlink(path);
+    return lw->failed ? -1 : 0;
+}
+
+static int valid_digest(const char *digest) {
+    return strlen(digest) == 64 && strspn(digest, "0123456789abcdef") == 64;
+}
+
+int apply_layer(const char *root, const char *digest) {
+    if (!valid_digest(digest)) {
+        fprintf(stderr, "invalid layer digest %s\n", digest);
+        return -1;
+    }
+    char staging[] = "/tmp/mocker-layerXXXXXX";
+    if (!mkdtemp(staging)) {
+        perror("mkdtemp");
+        return -1;
+    }
+    char layer[PATH_MAX];
+    snprintf(layer, sizeof(layer), "%s/%s.tar", LAYER_DIR, digest);
+    char * tar[] = { "tar", "--numeric-owner", "-C", staging, "-xf", layer, NULL };
+    int ret = run_argv(tar, NULL, 0);
+    int root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd == -1)
+        ret = -1;
+    if (ret == 0) {
+        layer_walk lw = { root_fd, staging, 0 };
+        walk_layer = &lw;
+        if (nftw(staging, whiteout_visit, 64, FTW_PHYS) != 0 || lw.failed)
+            ret = -1;
+    }
+    // Entry by entry, so the root directory keeps its own mode and owner
+    int staging_fd = ret == 0 ? open(staging, O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+    DIR *d = staging_fd >= 0 ? fdopendir(staging_fd) : NULL;
+    struct dirent *dir;
+    while (d && ret == 0 && (dir = readdir(d)) != NULL) {
+        if (strcmp(dir->d_name, ".") != 0 && strcmp(dir->d_name, "..") != 0 && copy_tree_at(dirfd(d), root_fd, dir->d_name) != 0) {
+            fprintf(stderr, "ERROR: copy %s: %s\n", dir->d_name, strerror(errno));
+            ret = -1;
+        }
+    }
+    if (d)
+        closedir(d);
+    else if (staging_fd >= 0)
+        close(staging_fd);
+    if (root_fd >= 0)
+        close(root_fd);
+    if (ret != 0)
+        fprintf(stderr, "applying layer %s failed\n", digest);
+    remove_tree(staging);
+    return ret;
+}
+
+int apply_image(const char *root, const char *image) {
+    char path[PATH_MAX];
+    if (!valid_name(image))
+        return -1;
+    snprintf(path, sizeof(path), "%s/%s", IMAGE_DIR, image);
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "image %s not found\n", image);
+        return -1;
+    }
+    char digest[128];
+    int ret = 0;
+    while (ret == 0 && fscanf(fp, "%127s", digest) == 1)
+        ret = apply_layer(root, digest);
+    fclose(fp);
+    return ret;
+}
+
+
+// Parses a byte count with an optional K, M or G suffix.
+static long long parse_bytes(const char *s) {
+    char *end;
+    long long value = strtoll(s, &end, 10);
+    if (end == s || value < 0)
+        return -1;
+    switch (*end) {
+    case 'G': case 'g': value <<= 10; /* fall through */
+    case 'M': case 'm': value <<= 10; /* fall through */
+    case 'K': case 'k': value <<= 10; end++; break;
+    }
+    return *end && *end != ',' ? -1 : value;
+}
+
+// Container state table: a fixed-layout file of STATE_SLOTS slots, mapped
+// shared by every supervisor. A supervisor claims a free slot for each
+// container and publishes its pid, cgroup, root, start time and status.
+// Each slot is a seqlock: writers make seq odd, update, and make it even
+// again, readers copy the slot and retry if seq moved. `mocker ps` and
+// `mocker inspect` read a consistent snapshot of every container without
+// locks and without touching /proc or /sys/fs/cgroup.
+//
+// The table also carries the launch scheduler's reservations (see
+// sched_admit()). Those fields only change under sched_lock.
+#define STATE_FILE MOCKER_RUN_DIR "/state"
+#define STATE_MAGIC 0x74617473u     // "stat"
+#define STATE_VERSION 2
+#define STATE_SLOTS 4096
+#define STATE_READ_TRIES 1000       // before a reader reports the slot as torn
+#define STATE_STUCK_MS 100          // a writer that held a slot this long has died
+#define MAX_CPUS 256                // exclusive cpusets only use the first MAX_CPUS
+#define CPUSET_WORDS (MAX_CPUS / 64)
+
+enum { SLOT_FREE, SLOT_RUNNING, SLOT_PAUSED, SLOT_QUEUED, SLOT_STARTING };
+
+typedef struct state_slot {
+    uint32_t seq;           // odd while a writer is updating the slot
+    uint32_t status;
+    int32_t owner;          // supervisor pid, 0 when the slot is free
+    int32_t pid;
+    int64_t started_ms;     // CLOCK_REALTIME, time of arrival while queued
+    char name[64];
+    char cgroup_path[256];
+    char root[160];
+    uint64_t ticket;        // arrival order among queued launches
+    uint64_t mem_bytes;     // reserved memory.max
+    uint32_t cpu_milli;     // reserved cpu.max, thousandths of a CPU
+    int32_t priority;
+    uint64_t cpuset[CPUSET_WORDS];  // exclusively reserved CPUs
+    char tenant[32];
+} __attribute__((aligned(64))) state_slot;
+
+// state_replace_old() finds the owners of older tables at this offset
+_Static_assert(offsetof(state_slot, owner) == 8, "state_slot.owner must stay at offset 8");
+
+typedef struct state_table {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slot_count;
+    uint32_t slot_size;
+    pthread_mutex_t sched_lock;     // process-shared and robust
+    uint32_t sched_gen;             // futex, bumped whenever a queued launch may now fit
+    uint32_t queued;
+    uint32_t sched_dirty;           // totals below need a rescan
+    uint64_t next_ticket;
+    uint64_t mem_committed;
+    uint64_t cpu_committed_milli;
+    uint64_t cpuset_committed[CPUSET_WORDS];
+    state_slot slots[STATE_SLOTS] __attribute__((aligned(64)));
+} state_table;
+
+static state_table * state;
+
+// Fills in a new, all-zero table
+static void state_init(state_table *table) {
+    table->slot_count = STATE_SLOTS;
+    table->slot_size = sizeof(state_slot);
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&table->sched_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    __atomic_store_n(&table->version, STATE_VERSION, __ATOMIC_RELEASE);
+}
+
+static int owner_alive(pid_t owner) {
+    return kops->kill(owner, 0) == 0 || errno == EPERM;
+}
+
+// Whether fd holds a table this build cannot use: another size, or another
+// version once the header has been filled in
+static int state_is_old(int fd, const struct stat *st) {
+    uint32_t hdr[2];
+    if (st->st_size == 0)
+        return 0;
+    if (st->st_size != sizeof(state_table) || pread(fd, hdr, sizeof(hdr), 0) != sizeof(hdr))
+        return 1;
+    return (hdr[0] != 0 && hdr[0] != STATE_MAGIC) || (hdr[0] == STATE_MAGIC && hdr[1] != 0 && hdr[1] != STATE_VERSION);
+}
+
+// Replaces a table of another version with an empty one, once no live
+// supervisor owns a slot in it. Every layout so far starts with magic,
+// version, slot_count and slot_size, ends with its slots, and keeps each
+// slot's owner pid at offset 8. Returns 0 once STATE_FILE may be opened
+// again, -1 when the old table is still in use or unreadable.
+static int state_replace_old(int fd, const struct stat *st) {
+    uint32_t hdr[4];
+    if (pread(fd, hdr, sizeof(hdr), 0) != sizeof(hdr) || hdr[0] != STATE_MAGIC || hdr[3] < 12 ||
+        (uint64_t) hdr[2] * hdr[3] > (uint64_t) st->st_size) {
+        fprintf(stderr, "%s is not a mocker state table; remove it and run mocker again\n", STATE_FILE);
+        return -1;
+    }
+    // One supervisor replaces it; the others find a new file afterwards
+    flock(fd, LOCK_EX);
+    struct stat now;
+    if (stat(STATE_FILE, &now) == 0 && (now.st_ino != st->st_ino || now.st_dev != st->st_dev))
+        return 0;
+    unsigned char *old = mmap(NULL, st->st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (old == MAP_FAILED) {
+        perror("mmap " STATE_FILE);
+        return -1;
+    }
+    const unsigned char *slots = old + st->st_size - (uint64_t) hdr[2] * hdr[3];
+    pid_t live = 0;
+    for (uint32_t i = 0; i < hdr[2] && !live; i++) {
+        int32_t owner;
+        memcpy(&owner, slots + (uint64_t) i * hdr[3] + 8, sizeof(owner));
+        if (owner > 0 && owner_alive(owner))
+            live = owner;
+    }
+    munmap(old, st->st_size);
+    if (live) {
+        fprintf(stderr, "%s is a version %u state table still used by mocker %d. "
+                "Let the older mocker processes exit, or remove %s, then run mocker again.\n",
+                STATE_FILE, hdr[1], live, STATE_FILE);
+        return -1;
+    }
+    char tmp[64];
+    snprintf(tmp, sizeof(tmp), "%s.%d", STATE_FILE, getpid());
+    int new_fd = open(tmp, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (new_fd == -1 || rename(tmp, STATE_FILE) == -1) {
+        perror("replace " STATE_FILE);
+        if (new_fd != -1) {
+            close(new_fd);
+            unlink(tmp);
+        }
+        return -1;
+    }
+    close(new_fd);
+    if (!quiet)
+        fprintf(stderr, "replaced the unused version %u state table %s\n", hdr[1], STATE_FILE);
+    return 0;
+}
+
+// Maps the table, creating it on first use. Failures only disable
+// publishing; containers run the same without it.
+static state_table *state_map(int create) {
+    if (state)
+        return state;
+    if (create && make_run_dir(MOCKER_RUN_DIR) != 0)
+        return NULL;
+    int fd;
+    struct stat st;
+    for (int tries = 0;; tries++) {
+        fd = open(STATE_FILE, O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0644);
+        if (fd == -1) {
+            if (create || errno != ENOENT)
+                perror("open " STATE_FILE);
+            return NULL;
+        }
+        if (fstat(fd, &st) == -1) {
+            perror("fstat " STATE_FILE);
+            close(fd);
+            return NULL;
+        }
+        if (!state_is_old(fd, &st))
+            break;
+        int ret = tries < 3 ? state_replace_old(fd, &st) : -1;
+        close(fd);
+        if (ret != 0)
+            return NULL;
+    }
+    if (st.st_size != sizeof(state_table) && ftruncate(fd, sizeof(state_table)) == -1) {
+        perror("ftruncate " STATE_FILE);
+        close(fd);
+        return NULL;
+    }
+    state_table *table = mmap(NULL, sizeof(state_table), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (table == MAP_FAILED) {
+        perror("mmap " STATE_FILE);
+        return NULL;
+    }
+    // A new file is all zeroes; whoever wins the magic fills in the rest
+    uint32_t expected = 0;
+    if (__atomic_compare_exchange_n(&table->magic, &expected, STATE_MAGIC, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        state_init(table);
+    } else {
+        while (expected == STATE_MAGIC && __atomic_load_n(&table->version, __ATOMIC_ACQUIRE) == 0)
+            sched_yield();
+    }
+    if ((expected != 0 && expected != STATE_MAGIC) || table->version != STATE_VERSION) {
+        fprintf(stderr, "%s is not a version %d state table; remove it and run mocker again\n", STATE_FILE, STATE_VERSION);
+        munmap(table, sizeof(state_table));
+        return NULL;
+    }
+    state = table;
+    return state;
+}
+
+// A writer that dies between begin and end leaves seq odd. Once the same
+// odd seq has been seen for STATE_STUCK_MS, the next writer takes the slot
+// over from it (seq + 2 keeps it odd), and its state_write_end() makes the
+// slot readable again. This may run with sched_lock held, so it must not
+// wait forever.
+static void state_write_begin(state_slot *slot) {
+    uint32_t stuck_seq = 0;
+    long stuck_since = 0;
+    for (;;) {
+        uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+        if (!(seq & 1) && __atomic_compare_exchange_n(&slot->seq, &seq, seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+        if (seq & 1) {
+            long now = monotonic_ms();
+            if (seq != stuck_seq || !stuck_since) {
+                stuck_seq = seq;
+                stuck_since = now;
+            } else if (now - stuck_since >= STATE_STUCK_MS &&
+                       __atomic_compare_exchange_n(&slot->seq, &seq, seq + 2, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                break;
+            }
+        }
+        sched_yield();
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void state_write_end(state_slot *slot) {
+    __atomic_fetch_add(&slot->seq, 1, __ATOMIC_RELEASE);
+}
+
+// Copies a consistent snapshot of slot into out. Returns 1 for a used slot,
+// 0 for a free one and -1 when no consistent copy could be taken within
+// STATE_READ_TRIES, e.g. because a writer died halfway through.
+static int state_read(const state_slot *slot, state_slot *out) {
+    for (int i = 0; i < STATE_READ_TRIES; i++) {
+        uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+        memcpy(out, slot, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq)
+            return out->owner != 0;
+    }
+    return -1;
+}
+
+// Claims a free slot, or one whose supervisor died without freeing it.
+static state_slot *state_claim(void) {
+    state_table *table = state_map(1);
+    if (!table)
+        return NULL;
+    pid_t self = kops->getpid();
+    static unsigned int hint;
+    unsigned int start = (self * 131u + hint++) % STATE_SLOTS;
+    for (unsigned int i = 0; i < STATE_SLOTS; i++) {
+        state_slot *slot = &table->slots[(start + i) % STATE_SLOTS];
+        int32_t owner = __atomic_load_n(&slot->owner, __ATOMIC_RELAXED);
+        if (owner != 0 && owner_alive(owner))
+            continue;
+        if (__atomic_compare_exchange_n(&slot->owner, &owner, self, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            if (owner != 0) {
+                // What the dead supervisor held is still in the scheduler's
+                // totals, and it may have died in the middle of a write
+                __atomic_store_n(&table->sched_dirty, 1, __ATOMIC_RELAXED);
+                uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+                if (seq & 1)
+                    __atomic_compare_exchange_n(&slot->seq, &seq, seq + 1, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+                state_write_begin(slot);
+                slot->status = SLOT_FREE;
+                slot->name[0] = '\0';
+                state_write_end(slot);
+            }
+            return slot;
+        }
+    }
+    fprintf(stderr, "state table full\n");
+    return NULL;
+}
+
+void state_publish(state_slot *slot, const char *name, pid_t pid, const char *cgroup_path, const char *root) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    state_write_begin(slot);
+    slot->status = SLOT_RUNNING;
+    slot->pid = pid;
+    slot->started_ms = now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+    snprintf(slot->name, sizeof(slot->name), "%s", name);
+    snprintf(slot->cgroup_path, sizeof(slot->cgroup_path), "%s", cgroup_path);
+    snprintf(slot->root, sizeof(slot->root), "%s", root);
+    state_write_end(slot);
+}
+
+// Launch scheduler. Before its root is built, every launch reserves its
+// memory.max, its cpu.max and, with --cpuset, whole CPUs in its state slot,
+// so the reservations of every supervisor on the host are checked together
+// against MemTotal and the CPUs we may run on. A launch that does not fit
+// waits in the queue, or fails with --admit=reject. The queue is ordered by
+// priority class, then by the dominant share (the larger of its memory and
+// CPU fractions) its tenant already holds, then by arrival. Only the head of
+// the queue may start, so a large launch is not starved by small ones
+// arriving behind it.
+enum { PRIO_LOW = -1, PRIO_NORMAL = 0, PRIO_HIGH = 1 };
+enum { ADMIT_QUEUE, ADMIT_REJECT, ADMIT_FORCE };
+
+#define DEFAULT_CPUS 0.1            // cpu.max without --cpus or --cpuset
+#define SCHED_MAX_TENANTS 64
+#define SCHED_POLL_MS 100           // also notices supervisors that died
+
+typedef struct host_capacity {
+    uint64_t mem_bytes;             // MemTotal
+    int ncpus;                      // CPUs we may run on
+    uint64_t cpus[CPUSET_WORDS];
+    int core[MAX_CPUS];             // package << 16 | core_id, same for SMT siblings
+} host_capacity;
+
+typedef struct sched_request {
+    uint64_t mem_bytes;
+    uint32_t cpu_milli;
+    int cpuset;
+    int priority;
+    const char * tenant;
+} sched_request;
+
+typedef struct tenant_usage {
+    char name[32];
+    uint64_t mem_bytes;
+    uint64_t cpu_milli;             // exclusive CPUs count 1000 each
+} tenant_usage;
+
+static int cpubit_test(const uint64_t *set, int cpu) {
+    return (set[cpu / 64] >> (cpu % 64)) & 1;
+}
+
+static void cpubit_set(uint64_t *set, int cpu) {
+    set[cpu / 64] |= 1ULL << (cpu % 64);
+}
+
+static int cpubit_count(const uint64_t *set) {
+    int n = 0;
+    for (int i = 0; i < CPUSET_WORDS; i++)
+        n += __builtin_popcountll(set[i]);
+    return n;
+}
+
+// Formats a set as a cpuset.cpus list, e.g. "0-3,6"
+static void format_cpu_list(const uint64_t *set, char *buf, size_t size) {
+    size_t len = 0;
+    buf[0] = '\0';
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (!cpubit_test(set, cpu))
+            continue;
+        int last = cpu;
+        while (last + 1 < MAX_CPUS && cpubit_test(set, last + 1))
+            last++;
+        int n = last == cpu ? snprintf(buf + len, size - len, "%s%d", len ? "," : "", cpu)
+                            : snprintf(buf + len, size - len, "%s%d-%d", len ? "," : "", cpu, last);
+        if (n < 0 || (size_t) n >= size - len)
+            break;
+        len += n;
+        cpu = last;
+    }
+}
+
+static long read_topology(int cpu, const char *file) {
+    char path[128], buf[32];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, file);
+    ssize_t n = kops->read_file(path, buf, sizeof(buf) - 1);
+    if (n <= 0)
+        return -1;
+    buf[n] = '\0';
+    return atol(buf);
+}
+
+// Host capacity, read once per supervisor
+static const host_capacity *host_capacity_get(void) {
+    static host_capacity hc;
+    static int done;
+    if (done)
+        return &hc;
+    done = 1;
+
+    char buf[256];
+    unsigned long long kb;
+    ssize_t n = kops->read_file("/proc/meminfo", buf, sizeof(buf) - 1);
+    if (n > 0)
+        buf[n] = '\0';
+    if (n <= 0 || sscanf(buf, "MemTotal: %llu kB", &kb) != 1) {
+        fprintf(stderr, "WARNING: MemTotal not available, memory is not scheduled\n");
+        hc.mem_bytes = UINT64_MAX;
+    } else {
+        hc.mem_bytes = kb * 1024;
+    }
+
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        CPU_ZERO(&allowed);
+        CPU_SET(0, &allowed);
+    }
+    hc.ncpus = CPU_COUNT(&allowed);
+    for (int cpu = 0; cpu < MAX_CPUS && cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed))
+            continue;
+        cpubit_set(hc.cpus, cpu);
+        long core = read_topology(cpu, "core_id");
+        long package = read_topology(cpu, "physical_package_id");
+        // Without topology every CPU counts as a core of its own
+        hc.core[cpu] = core < 0 || package < 0 ? -1 - cpu : (int) (package << 16 | core);
+    }
+    return &hc;
+}
+
+static void sched_request_init(sched_request *r, const run_options *opts) {
+    const memory_profile *mp = &opts->memory;
+    long long mem = mp->memory_max ? parse_bytes(mp->memory_max) : -1;
+    // memory.max=max is no limit, reserve what the cgroup is protected for
+    if (mem < 0) {
+        long long low = mp->memory_low ? parse_bytes(mp->memory_low) : -1;
+        long long min = mp->memory_min ? parse_bytes(mp->memory_min) : -1;
+        mem = low > min ? low : min;
+    }
+    r->mem_bytes = mem > 0 ? mem : 0;
+    r->cpuset = opts->cpuset;
+    r->cpu_milli = opts->cpuset ? 0 : (uint32_t) ((opts->cpus > 0 ? opts->cpus : DEFAULT_CPUS) * 1000 + 0.5);
+    r->priority = opts->priority;
+    r->tenant = opts->tenant ? opts->tenant : "default";
+}
+
+// Picks n CPUs out of those not in taken, into out. Whole free cores go
+// first, so a container does not share a core's caches and execution units
+// with a neighbour, then single CPUs. Returns -1 if there are not enough.
+static int sched_pick_cpus(const host_capacity *hc, const uint64_t *taken, int n, uint64_t *out) {
+    memset(out, 0, sizeof(uint64_t) * CPUSET_WORDS);
+    int picked = 0;
+    for (int cpu = 0; cpu < MAX_CPUS && picked < n; cpu++) {
+        if (!cpubit_test(hc->cpus, cpu) || cpubit_test(taken, cpu) || cpubit_test(out, cpu))
+            continue;
+        int siblings = 0, free = 1;
+        for (int s = 0; s < MAX_CPUS; s++) {
+            if (!cpubit_test(hc->cpus, s) || hc->core[s] != hc->core[cpu])
+                continue;
+            siblings++;
+            if (cpubit_test(taken, s))
+                free = 0;
+        }
+        if (!free || siblings > n - picked)
+            continue;
+        for (int s = cpu; s < MAX_CPUS; s++) {
+            if (cpubit_test(hc->cpus, s) && hc->core[s] == hc->core[cpu]) {
+                cpubit_set(out, s);
+                picked++;
+            }
+        }
+    }
+    for (int cpu = 0; cpu < MAX_CPUS && picked < n; cpu++) {
+        if (cpubit_test(hc->cpus, cpu) && !cpubit_test(taken, cpu) && !cpubit_test(out, cpu)) {
+            cpubit_set(out, cpu);
+            picked++;
+        }
+    }
+    return picked == n ? 0 : -1;
+}
+
+// Whether r fits next to what is committed, with the CPUs it would get in cpus
+static int sched_fits(const state_table *t, const host_capacity *hc, const sched_request *r, uint64_t *cpus) {
+    memset(cpus, 0, sizeof(uint64_t) * CPUSET_WORDS);
+    if (t->mem_committed > hc->mem_bytes || r->mem_bytes > hc->mem_bytes - t->mem_committed)
+        return 0;
+    if (r->cpuset && sched_pick_cpus(hc, t->cpuset_committed, r->cpuset, cpus) != 0)
+        return 0;
+    // Exclusive CPUs are taken out of what the cpu.max reservations share
+    long long shared = (long long) (hc->ncpus - cpubit_count(t->cpuset_committed) - r->cpuset) * 1000;
+    return (long long) (t->cpu_committed_milli + r->cpu_milli) <= shared;
+}
+
+static void sched_lock(state_table *t) {
+    if (pthread_mutex_lock(&t->sched_lock) == EOWNERDEAD) {
+        // Its holder died, possibly halfway through updating the totals
+        pthread_mutex_consistent(&t->sched_lock);
+        t->sched_dirty = 1;
+    }
+}
+
+// changed: capacity was freed or the head of the queue moved
+static void sched_unlock(state_table *t, int changed) {
+    int wake = changed && t->queued > 0;
+    if (changed)
+        __atomic_fetch_add(&t->sched_gen, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&t->sched_lock);
+    if (wake)
+        syscall(SYS_futex, &t->sched_gen, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static tenant_usage *tenant_find(tenant_usage *tu, int *n, const char *name) {
+    for (int i = 0; i < *n; i++)
+        if (strncmp(tu[i].name, name, sizeof(tu[i].name)) == 0)
+            return &tu[i];
+    if (*n == SCHED_MAX_TENANTS)
+        return NULL;
+    tenant_usage *u = &tu[(*n)++];
+    memset(u, 0, sizeof(*u));
+    snprintf(u->name, sizeof(u->name), "%s", name);
+    return u;
+}
+
+static double dominant_share(const tenant_usage *u, const host_capacity *hc) {
+    if (!u)
+        return 0;
+    double mem = hc->mem_bytes == UINT64_MAX ? 0 : (double) u->mem_bytes / hc->mem_bytes;
+    double cpu = (double) u->cpu_milli / (hc->ncpus * 1000.0);
+    return mem > cpu ? mem : cpu;
+}
+
+// Rebuilds the totals from the slots of live supervisors, dropping whatever
+// dead ones held, and returns the queued launch that goes first. Called
+// with sched_lock held. The reservation fields only change under that lock,
+// so they are read directly rather than through state_read().
+static state_slot *sched_scan(state_table *t, const host_capacity *hc) {
+    static tenant_usage tenants[SCHED_MAX_TENANTS];
+    static int waiting[STATE_SLOTS];
+    int ntenants = 0, nwaiting = 0;
+
+    t->mem_committed = 0;
+    t->cpu_committed_milli = 0;
+    memset(t->cpuset_committed, 0, sizeof(t->cpuset_committed));
+    for (int i = 0; i < STATE_SLOTS; i++) {
+        state_slot *s = &t->slots[i];
+        int32_t owner = __atomic_load_n(&s->owner, __ATOMIC_ACQUIRE);
+        uint32_t status = __atomic_load_n(&s->status, __ATOMIC_ACQUIRE);
+        if (owner == 0 || status == SLOT_FREE || !owner_alive(owner))
+            continue;
+        if (status == SLOT_QUEUED) {
+            waiting[nwaiting++] = i;
+            continue;
+        }
+        t->mem_committed += s->mem_bytes;
+        t->cpu_committed_milli += s->cpu_milli;
+        for (int w = 0; w < CPUSET_WORDS; w++)
+            t->cpuset_committed[w] |= s->cpuset[w];
+        tenant_usage *u = tenant_find(tenants, &ntenants, s->tenant);
+        if (u) {
+            u->mem_bytes += s->mem_bytes;
+            u->cpu_milli += s->cpu_milli + 1000ULL * cpubit_count(s->cpuset);
+        }
+    }
+    t->queued = nwaiting;
+    t->sched_dirty = 0;
+
+    state_slot *head = NULL;
+    double head_share = 0;
+    for (int i = 0; i < nwaiting; i++) {
+        state_slot *s = &t->slots[waiting[i]];
+        double share = dominant_share(tenant_find(tenants, &ntenants, s->tenant), hc);
+        if (!head || s->priority > head->priority ||
+            (s->priority == head->priority && (share < head_share ||
+             (share == head_share && s->ticket < head->ticket)))) {
+            head = s;
+            head_share = share;
+        }
+    }
+    return head;
+}
+
+// Records r as held by slot. Called with sched_lock held.
+static void sched_commit(state_table *t, state_slot *slot, const sched_request *r, const uint64_t *cpus) {
+    state_write_begin(slot);
+    slot->status = SLOT_STARTING;
+    slot->mem_bytes = r->mem_bytes;
+    slot->cpu_milli = r->cpu_milli;
+    slot->priority = r->priority;
+    memcpy(slot->cpuset, cpus, sizeof(slot->cpuset));
+    snprintf(slot->tenant, sizeof(slot->tenant), "%s", r->tenant);
+    state_write_end(slot);
+    t->mem_committed += r->mem_bytes;
+    t->cpu_committed_milli += r->cpu_milli;
+    for (int w = 0; w < CPUSET_WORDS; w++)
+        t->cpuset_committed[w] |= cpus[w];
+}
+
+static void sched_enqueue(state_table *t, state_slot *slot, const sched_request *r, const char *name) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    state_write_begin(slot);
+    slot->status = SLOT_QUEUED;
+    slot->ticket = t->next_ticket++;
+    slot->started_ms = now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+    slot->mem_bytes = r->mem_bytes;
+    slot->cpu_milli = r->cpu_milli;
+    slot->priority = r->priority;
+    memset(slot->cpuset, 0, sizeof(slot->cpuset));
+    snprintf(slot->tenant, sizeof(slot->tenant), "%s", r->tenant);
+    snprintf(slot->name, sizeof(slot->name), "%s", name ? name : "");
+    state_write_end(slot);
+    t->queued++;
+}
+
+// Takes a slot's reservation or queue entry out of the totals. Called with
+// sched_lock held; returns whether there was anything to take out.
+static int sched_forget(state_table *t, state_slot *slot) {
+    if (slot->status == SLOT_QUEUED) {
+        if (t->queued > 0)
+            t->queued--;
+    } else if (slot->mem_bytes || slot->cpu_milli || cpubit_count(slot->cpuset)) {
+        if (t->mem_committed < slot->mem_bytes || t->cpu_committed_milli < slot->cpu_milli)
+            t->sched_dirty = 1;
+        t->mem_committed -= t->mem_committed < slot->mem_bytes ? t->mem_committed : slot->mem_bytes;
+        t->cpu_committed_milli -= t->cpu_committed_milli < slot->cpu_milli ? t->cpu_committed_milli : slot->cpu_milli;
+        for (int w = 0; w < CPUSET_WORDS; w++)
+            t->cpuset_committed[w] &= ~slot->cpuset[w];
+    } else {
+        return 0;
+    }
+    state_write_begin(slot);
+    slot->status = SLOT_FREE;
+    slot->mem_bytes = 0;
+    slot->cpu_milli = 0;
+    memset(slot->cpuset, 0, sizeof(slot->cpuset));
+    state_write_end(slot);
+    return 1;
+}
+
+// Admits a launch of opts, claiming *slotp on the first call. Returns 0 once
+// the reservation is held, 1 while it has to wait (only when wait is 0; the
+// slot keeps its place in the queue, call again later) and -1 when it is
+// rejected, with *slotp released. Without a state table launches are not
+// scheduled.
+int sched_admit(state_slot **slotp, const run_options *opts, int wait) {
+    state_table *t = state_map(1);
+    if (!t)
+        return opts->cpuset ? -1 : 0;
+    const host_capacity *hc = host_capacity_get();
+    sched_request r;
+    sched_request_init(&r, opts);
+
+    const char *why = NULL;
+    if (r.mem_bytes > hc->mem_bytes || r.cpu_milli > hc->ncpus * 1000u || r.cpuset > cpubit_count(hc->cpus))
+        why = "more than the host has";
+    state_slot *slot = *slotp;
+    if (!why && !slot) {
+        slot = *slotp = state_claim();
+        if (!slot)
+            return opts->cpuset ? -1 : 0;
+    }
+
+    long deadline = opts->queue_timeout_s > 0 ? monotonic_ms() + opts->queue_timeout_s * 1000L : 0;
+    int announced = 0;
+    while (!why) {
+        uint64_t cpus[CPUSET_WORDS] = {0};
+        int admit = 0, changed = 0;
+        sched_lock(t);
+        int queued = slot->status == SLOT_QUEUED;
+        if (opts->admit == ADMIT_FORCE) {
+            // Memory and CPU time may be oversubscribed, CPUs cannot be shared
+            admit = !r.cpuset || sched_pick_cpus(hc, t->cpuset_committed, r.cpuset, cpus) == 0;
+            if (!admit)
+                why = "not enough free CPUs";
+        } else if (!queued && t->queued == 0 && !t->sched_dirty) {
+            admit = sched_fits(t, hc, &r, cpus);
+        }
+        if (!admit && !why) {
+            if (!queued)
+                sched_enqueue(t, slot, &r, opts->name);
+            admit = sched_scan(t, hc) == slot && sched_fits(t, hc, &r, cpus);
+            if (!admit && opts->admit == ADMIT_REJECT)
+                why = "not enough capacity";
+            else if (!admit && deadline && monotonic_ms() >= deadline)
+                why = "timed out waiting for capacity";
+        }
+        if (admit) {
+            changed = slot->status == SLOT_QUEUED;
+            if (changed)
+                t->queued--;
+            sched_commit(t, slot, &r, cpus);
+        } else if (why) {
+            changed = sched_forget(t, slot);
+        }
+        uint32_t gen = t->sched_gen;
+        int others = t->queued - 1;
+        sched_unlock(t, changed);
+
+        if (admit)
+            return 0;
+        if (why)
+            break;
+        if (!wait)
+            return 1;
+        if (!announced && !quiet) {
+            printf("Queued for %" PRIu64 "M memory, %.2f CPUs, %d exclusive CPUs, %d other launches waiting\n",
+                   r.mem_bytes >> 20, r.cpu_milli / 1000.0, r.cpuset, others);
+            fflush(stdout);
+        }
+        announced = 1;
+        struct timespec ts = { 0, SCHED_POLL_MS * 1000000L };
+        syscall(SYS_futex, &t->sched_gen, FUTEX_WAIT, gen, &ts, NULL, 0);
+    }
+
+    if (!quiet)
+        fprintf(stderr, "launch rejected: %s (needs %" PRIu64 "M memory, %.2f CPUs, %d exclusive CPUs)\n",
+                why, r.mem_bytes >> 20, r.cpu_milli / 1000.0, r.cpuset);
+    if (slot) {
+        state_write_begin(slot);
+        slot->name[0] = '\0';
+        state_write_end(slot);
+        __atomic_store_n(&slot->owner, 0, __ATOMIC_RELEASE);
+    }
+    *slotp = NULL;
+    return -1;
+}
+
+// The CPUs shared containers run on: all of ours that no --cpuset launch
+// holds. Fails when there are none left.
+static int sched_shared_cpus(const state_table *t, const host_capacity *hc, char *list, size_t size) {
+    uint64_t shared[CPUSET_WORDS];
+    for (int w = 0; w < CPUSET_WORDS; w++)
+        shared[w] = hc->cpus[w] & ~t->cpuset_committed[w];
+    if (cpubit_count(shared) == 0)
+        return -1;
+    format_cpu_list(shared, list, size);
+    return 0;
+}
+
+// Moves every shared container of every supervisor onto the CPUs no
+// --cpuset launch holds, after that set changed. Called with sched_lock
+// held.
+static void sched_move_shared(state_table *t, const host_capacity *hc, const state_slot *except) {
+    char list[1024], path[PATH_MAX];
+    if (sched_shared_cpus(t, hc, list, sizeof(list)) != 0)
+        return;
+    for (int i = 0; i < STATE_SLOTS; i++) {
+        state_slot *s = &t->slots[i];
+        int32_t owner = __atomic_load_n(&s->owner, __ATOMIC_ACQUIRE);
+        uint32_t status = __atomic_load_n(&s->status, __ATOMIC_ACQUIRE);
+        if (s == except || owner == 0 || status == SLOT_FREE || status == SLOT_QUEUED || !s->cgroup_path[0] ||
+            cpubit_count(s->cpuset) || !owner_alive(owner))
+            continue;
+        // It may be torn down meanwhile; its supervisor then needs no update
+        snprintf(path, sizeof(path), "%s/%s", s->cgroup_path, CGROUP_CPUSET_FILE);
+        kops->write_file(path, list, strlen(list));
+    }
+}
+
+// Confines a new container's cgroup to its CPUs. A --cpuset container gets
+// the CPUs it reserved, and every shared container is moved off them, so
+// they are its alone. A shared container gets the CPUs no --cpuset
+// container holds. The slot records the cgroup under sched_lock, so a
+// --cpuset launch cannot miss a shared container that is starting.
+int sched_place(state_slot *slot, const char *cgroup_path) {
+    if (!state || !slot)
+        return 0;
+    const host_capacity *hc = host_capacity_get();
+    char list[1024];
+    int ret = 0;
+    sched_lock(state);
+    state_write_begin(slot);
+    snprintf(slot->cgroup_path, sizeof(slot->cgroup_path), "%s", cgroup_path);
+    state_write_end(slot);
+    if (cpubit_count(slot->cpuset)) {
+        format_cpu_list(slot->cpuset, list, sizeof(list));
+        ret = set_cgroup_value(cgroup_path, CGROUP_CPUSET_FILE, list);
+        if (ret == 0)
+            sched_move_shared(state, hc, slot);
+    } else if (cpubit_count(state->cpuset_committed) && sched_shared_cpus(state, hc, list, sizeof(list)) == 0) {
+        ret = set_cgroup_value(cgroup_path, CGROUP_CPUSET_FILE, list);
+    }
+    sched_unlock(state, 0);
+    return ret;
+}
+
+// Gives back the slot's reservation, if any, and frees it. Shared
+// containers get back the CPUs of a --cpuset container.
+void state_release(state_slot *slot) {
+    if (state) {
+        sched_lock(state);
+        int exclusive = cpubit_count(slot->cpuset) > 0;
+        int changed = sched_forget(state, slot);
+        if (changed && exclusive)
+            sched_move_shared(state, host_capacity_get(), slot);
+        sched_unlock(state, changed);
+    }
+    state_write_begin(slot);
+    slot->status = SLOT_FREE;
+    slot->pid = 0;
+    slot->name[0] = '\0';
+    state_write_end(slot);
+    __atomic_store_n(&slot->owner, 0, __ATOMIC_RELEASE);
+}
+
+// Finds a published container by name. Any process may update its status,
+// the seqlock's CAS on seq makes concurrent writers take turns.
+void state_set_status(const char *name, uint32_t status) {
+    state_table *table = state_map(0);
+    if (!table)
+        return;
+    for (unsigned int i = 0; i < STATE_SLOTS; i++) {
+        state_slot *slot = &table->slots[i];
+        state_slot snap;
+        if (state_read(slot, &snap) <= 0 || strcmp(snap.name, name) != 0)
+            continue;
+        state_write_begin(slot);
+        if (strcmp(slot->name, name) == 0)
+            slot->status = status;
+        state_write_end(slot);
+    }
+}
+
+// Parses one `run` option at args[*index]. Returns 1 when consumed, 0 when
+// args[*index] is not a run option and -1 on a bad value.
+// Checks a --memory-max style value at parse time, so a typo fails here
+// instead of reserving nothing in the scheduler and failing at the cgroup
+// write. `min` is the smallest byte count accepted.
+static int valid_memory_value(const char *opt, const char *value, long long min) {
+    if (strcmp(value, "max") == 0 || (!strchr(value, ',') && parse_bytes(value) >= min))
+        return 1;
+    fprintf(stderr, "Invalid %.*s %s (bytes with an optional K, M or G suffix, or max)\n",
+            (int) (strchr(opt, '=') - opt), opt, value);
+    return 0;
+}
+
+int parse_run_option(run_options *opts, int argc, char ** args, int *index)
+{
+    char * opt = args[*index];
+    if (strcmp(opt, "--perf") == 0) {
+        opts->perf = 1;
+    } else if (strncmp(opt, "--perf=", 7) == 0) {
+        opts->perf = 1;
+        opts->perf_interval_ms = atoi(opt + 7);
+    } else if (strncmp(opt, "--memory-profile=", 17) == 0) {
+        const memory_profile * mp = find_memory_profile(opt + 17);
+        if (!mp) {
+            fprintf(stderr, "Unknown memory profile %s (default, latency, batch)\n", opt + 17);
+            return -1;
+        }
+        opts->memory = *mp;
+    } else if (strncmp(opt, "--memory-max=", 13) == 0) {
+        opts->memory.memory_max = opt + 13;
+        if (!valid_memory_value(opt, opts->memory.memory_max, 1))
+            return -1;
+    } else if (strncmp(opt, "--memory-low=", 13) == 0) {
+        opts->memory.memory_low = opt + 13;
+        if (!valid_memory_value(opt, opts->memory.memory_low, 0))
+            return -1;
+    } else if (strncmp(opt, "--memory-min=", 13) == 0) {
+        opts->memory.memory_min = opt + 13;
+        if (!valid_memory_value(opt, opts->memory.memory_min, 0))
+            return -1;
+    } else if (strncmp(opt, "--swap-max=", 11) == 0) {
+        opts->memory.swap_max = opt + 11;
+        if (!valid_memory_value(opt, opts->memory.swap_max, 0))
+            return -1;
+    } else if (strncmp(opt, "--hugetlb-max=", 14) == 0) {
+        opts->memory.hugetlb_max = opt + 14;
+    } else if (strcmp(opt, "--thp=never") == 0) {
+        opts->memory.thp = THP_NEVER;
+    } else if (strcmp(opt, "--thp=madvise") == 0) {
+        opts->memory.thp = THP_MADVISE;
+    } else if (strcmp(opt, "--thp=default") == 0) {
+        opts->memory.thp = THP_DEFAULT;
+    } else if (strncmp(opt, "--reclaim=", 10) == 0) {
+        // --reclaim=<ms>[:<amount>]
+        opts->memory.reclaim_interval_ms = atoi(opt + 10);
+        char * amount = strchr(opt + 10, ':');
+        opts->memory.reclaim_amount = amount ? amount + 1 : "64M";
+    } else if (strncmp(opt, "--auto-deps=", 12) == 0) {
+        opts->auto_deps = opt + 12;
+    } else if (strcmp(opt, "--auto-deps") == 0 && *index + 1 < argc) {
+        opts->auto_deps = args[++*index];
+    } else if (strcmp(opt, "--record-boot") == 0) {
+        opts->record_boot_ms = 1000;
+    } else if (strncmp(opt, "--record-boot=", 14) == 0) {
+        opts->record_boot_ms = atoi(opt + 14);
+    } else if (strcmp(opt, "--ring") == 0) {
+        opts->ring_size = 1 << 20;
+    } else if (strncmp(opt, "--ring=", 7) == 0) {
+        char *end;
+        errno = 0;
+        unsigned long size = strtoul(opt + 7, &end, 0);
+        if (errno || end == opt + 7 || *end || size < 4096 || size > (1ul << 30) || (size & (size - 1))) {
+            fprintf(stderr, "Invalid --ring %s (a power of two from 4096 to %lu bytes)\n", opt + 7, 1ul << 30);
+            return -1;
+        }
+        opts->ring_size = size;
+    } else if (strncmp(opt, "--name=", 7) == 0) {
+        opts->name = opt + 7;
+    } else if (strcmp(opt, "--name") == 0 && *index + 1 < argc) {
+        opts->name = args[++*index];
+    } else if (strcmp(opt, "--init") == 0) {
+        // Init runs in the child before execvp, on the supervisor's memory
+        // under CLONE_VM, and would have to stay there
+        if (opts->launch_vm) {
+            fprintf(stderr, "--init cannot be combined with --launch=vm\n");
+            return -1;
+        }
+        opts->init = 1;
+    } else if (strncmp(opt, "--cpus=", 7) == 0) {
+        opts->cpus = atof(opt + 7);
+        if (opts->cpus <= 0) {
+            fprintf(stderr, "Invalid --cpus %s\n", opt + 7);
+            return -1;
+        }
+    } else if (strncmp(opt, "--cpuset=", 9) == 0) {
+        opts->cpuset = atoi(opt + 9);
+        if (opts->cpuset <= 0 || opts->cpuset > MAX_CPUS) {
+            fprintf(stderr, "Invalid --cpuset %s (1-%d CPUs)\n", opt + 9, MAX_CPUS);
+            return -1;
+        }
+    } else if (strncmp(opt, "--priority=", 11) == 0) {
+        const char *p = opt + 11;
+        if (strcmp(p, "high") == 0) {
+            opts->priority = PRIO_HIGH;
+        } else if (strcmp(p, "normal") == 0) {
+            opts->priority = PRIO_NORMAL;
+        } else if (strcmp(p, "low") == 0) {
+            opts->priority = PRIO_LOW;
+        } else {
+            fprintf(stderr, "Unknown priority %s (high, normal, low)\n", p);
+            return -1;
+        }
+    } else if (strncmp(opt, "--tenant=", 9) == 0) {
+        opts->tenant = opt + 9;
+        if (!valid_name(opts->tenant) || strlen(opts->tenant) >= sizeof(((state_slot *) 0)->tenant)) {
+            fprintf(stderr, "Invalid tenant %s\n", opts->tenant);
+            return -1;
+        }
+    } else if (strncmp(opt, "--admit=", 8) == 0) {
+        const char *a = opt + 8;
+        if (strcmp(a, "queue") == 0) {
+            opts->admit = ADMIT_QUEUE;
+        } else if (strcmp(a, "reject") == 0) {
+            opts->admit = ADMIT_REJECT;
+        } else if (strcmp(a, "force") == 0) {
+            opts->admit = ADMIT_FORCE;
+        } else {
+            fprintf(stderr, "Unknown admission policy %s (queue, reject, force)\n", a);
+            return -1;
+        }
+    } else if (strncmp(opt, "--queue-timeout=", 16) == 0) {
+        char *end;
+        errno = 0;
+        long timeout = strtol(opt + 16, &end, 10);
+        if (end == opt + 16 || *end || errno || timeout < 0 || timeout > INT_MAX) {
+            fprintf(stderr, "Invalid --queue-timeout %s (seconds, 0: never)\n", opt + 16);
+            return -1;
+        }
+        opts->queue_timeout_s = timeout;
+    } else if (strcmp(opt, "--launch=vm") == 0) {
+        if (opts->init) {
+            fprintf(stderr, "--init cannot be combined with --launch=vm\n");
+            return -1;
+        }
+        opts->launch_vm = 1;
+    } else if (strcmp(opt, "--launch=fork") == 0) {
+        opts->launch_vm = 0;
+    } else if (strcmp(opt, "--snapshot") == 0) {
+        opts->snapshot = 1;
+    } else if (strncmp(opt, "--image=", 8) == 0) {
+        opts->image = opt + 8;
+    } else if (strcmp(opt, "--image") == 0 && *index + 1 < argc) {
+        opts->image = args[++*index];
+    } else if (strncmp(opt, "--pod=", 6) == 0) {
+        opts->pod = opt + 6;
+    } else if (strcmp(opt, "--pod") == 0 && *index + 1 < argc) {
+        opts->pod = args[++*index];
+    } else {
+        return 0;
+    }
+    ++*index;
+    return 1;
+}
+
+// A launched container, from setup_temp_dir() to teardown. `stage` names
+// the step that failed when container_start() returns -1.
+typedef struct container {
+    char temp_dir[1024];
+    char cgroup_path[PATH_MAX];
+    const char * name;
+    char ** cmd_args;
+    char * stack;
+    child_args ca;
+    int pipefd[2];
+    pid_t pid;
+    perf_session perf;
+    int perf_active;
+    struct mockring_view ring;  // ring.ring is NULL without --ring
+    int ring_fd;
+    int fan_fd;             // boot trace recorder, -1 when not recording
+    char ** envp;           // environ plus MOCKER_RING_FD, NULL without a ring
+    char ring_env[32];
+    double clone_ms;        // time spent in clone() itself
+    state_slot * slot;      // entry in the state table, NULL if unpublished
+    int snapshot;           // a manifest was recorded under the name
+    const char * stage;
+} container;
+
+void container_finish(container *c);
+int container_launch(container *c, const run_options *opts, char ** cmd, int cmd_count);
+
+void container_reset(container *c)
+{
+    memset(c, 0, sizeof(*c));
+    c->pid = -1;
+    c->pipefd[0] = c->pipefd[1] = -1;
+    c->ring_fd = -1;
+    c->fan_fd = -1;
+}
+
+// Waits for the scheduler to admit the launch, unless the caller already
+// holds an admitted slot, builds the root, then launches the container into
+// it with container_launch(). On failure everything created so far is torn
+// down again.
+int container_start(container *c, const run_options *opts, char ** cmd, int cmd_count, state_slot *admitted)
+{
+    container_reset(c);
+    c->slot = admitted;
+
+    c->stage = "name";
+    if (opts->name && !valid_name(opts->name)) {
+        fprintf(stderr, "invalid container name %s\n", opts->name);
+        goto fail;
+    }
+
+    c->stage = "admit";
+    if (!c->slot && sched_admit(&c->slot, opts, 1) != 0) {
+        goto fail;
+    }
+
+    // The host files the root is copied from are read next
+    if (opts->record_boot_ms <= 0)
+        boot_prefetch(NULL, cmd, cmd_count);
+
+    // Setup temporary directory
+    c->stage = "setup_temp_dir";
+    if (setup_temp_dir(c->temp_dir) == -1) {
+        goto fail;
+    }
+    c->name = opts->name ? opts->name : strrchr(c->temp_dir, '/') + 1;
+    if (!quiet)
+        printf("Container %s\n", c->name);
+
+    // Taking the name before the root is built keeps a second container of
+    // the same name from overwriting this one's snapshot
+    c->stage = "cgroup";
+    if (create_container_cgroup(c->cgroup_path, sizeof(c->cgroup_path), c->name) != 0) {
+        c->cgroup_path[0] = '\0';
+        goto fail;
+    }
+    c->stage = "auto-deps";
+    if (opts->auto_deps && install_closure(c->temp_dir, opts->auto_deps) != 0) {
+        goto fail;
+    }
+    c->stage = "image";
+    if (opts->image && apply_image(c->temp_dir, opts->image) != 0) {
+        goto fail;
+    }
+    c->stage = "snapshot";
+    if (opts->snapshot) {
+        if (snapshot_baseline(c->temp_dir, c->name, opts->image) != 0) {
+            goto fail;
+        }
+        c->snapshot = 1;
+    }
+    if (opts->record_boot_ms > 0) {
+        c->fan_fd = boot_record_start(c->temp_dir);
+    } else {
+        boot_prefetch(c->temp_dir, cmd, cmd_count);
+    }
+
+    return container_launch(c, opts, cmd, cmd_count);
+
+fail:
+    container_finish(c);
+    return -1;
+}
+
+// Clones the child into its namespaces, sets up id maps and the cgroup,
+// then releases the child into execvp. c->name and c->temp_dir must be set,
+// and c->slot holds the admitted reservation, if any.
+// kernel-bench runs this against the fake kernel to time mocker's own work.
+int container_launch(container *c, const run_options *opts, char ** cmd, int cmd_count)
+{
+    c->stage = "malloc";
+    c->cmd_args = malloc(sizeof(char *) * (cmd_count + 2)); // command and its arguments, plus 1 for temp_dir and 1 for the NULL terminator
+    if (!c->cmd_args) {
+        perror("malloc");
+        goto fail;
+    }
+    c->cmd_args[0] = c->temp_dir;
+    for (int i = 0; i < cmd_count; i++)
+    {
+        c->cmd_args[i + 1] = cmd[i];
+    }
+    c->cmd_args[cmd_count + 1] = NULL;
+
+    c->stack = malloc(STACK_SIZE);
+    if (c->stack == NULL)
+    {
+        perror("malloc");
+        goto fail;
+    }
+
+    c->stage = "pipe";
+    if (kops->pipe(c->pipefd) != 0) {
+        perror("pipe");
+        goto fail;
+    }
+
+    c->ca.cmd_args = c->cmd_args;
+    c->ca.pipefd[0] = c->pipefd[0];
+    c->ca.pipefd[1] = c->pipefd[1];
+    c->ca.thp = opts->memory.thp;
+    c->ca.in_pod = opts->pod != NULL;
+    c->ca.ring_fd = -1;
+    c->ca.envp = environ;
+    c->ca.init = opts->init;
+
+    if (opts->ring_size) {
+        c->stage = "ring";
+        if (mockring_create(&c->ring, opts->ring_size, &c->ring_fd) != 0) {
+            perror("mockring_create");
+            goto fail;
+        }
+        c->ca.ring_fd = c->ring_fd;
+
+        // The child cannot setenv() (it may share our heap), so its
+        // environment is put together here
+        size_t n = 0;
+        while (environ[n])
+            n++;
+        c->envp = malloc(sizeof(char *) * (n + 2));
+        if (!c->envp) {
+            perror("malloc");
+            goto fail;
+        }
+        size_t j = 0;
+        size_t key_len = strlen(MOCKRING_ENV);
+        for (size_t i = 0; i < n; i++) {
+            if (strncmp(environ[i], MOCKRING_ENV, key_len) != 0 || environ[i][key_len] != '=')
+                c->envp[j++] = environ[i];
+        }
+        snprintf(c->ring_env, sizeof(c->ring_env), "%s=%d", MOCKRING_ENV, c->ring_fd);
+        c->envp[j++] = c->ring_env;
+        c->envp[j] = NULL;
+        c->ca.envp = c->envp;
+    }
+
+    int clone_flags = CLONE_NEWUSER | CLONE_NEWNET | CLONE_NEWIPC | CLONE_NEWUTS | CLONE_NEWNS | CLONE_NEWPID | SIGCHLD;
+    if (opts->pod) {
+        c->stage = "pod";
+        if (pod_join(opts->pod) != 0) {
+            goto fail;
+        }
+        clone_flags &= ~(CLONE_NEWNET | CLONE_NEWIPC | CLONE_NEWUTS);
+    }
+    // Without CLONE_VM the kernel copies every page table of the supervisor,
+    // so clone() gets slower as the supervisor grows. With it the child runs
+    // on its own stack in our address space until execvp replaces it, and
+    // clone() costs the same at any size. The child stays off the heap and
+    // only reads child_args, which nothing here modifies before the child
+    // is reaped. errno is shared between the two in the meantime.
+    if (opts->launch_vm) {
+        clone_flags |= CLONE_VM;
+    }
+
+    // Create a new user, mount, and PID namespace, plus UTS, IPC and net
+    // unless they come from the pod
+    c->stage = "clone";
+    struct timespec clone_start;
+    clock_gettime(CLOCK_MONOTONIC, &clone_start);
+    c->pid = kops->clone(run_command, c->stack + STACK_SIZE, clone_flags, &c->ca);
+    c->clone_ms = elapsed_ms(&clone_start);
+    if (c->pid == -1) {
+        perror("clone");
+        goto fail;
+    }
+
+    char map_path[PATH_MAX];
+
+    c->stage = "uid_map";
+    snprintf(map_path, PATH_MAX, "/proc/%ld/uid_map",  (intmax_t) c->pid);
+    if (update_map(CONTAINER_ID_MAP, map_path) != 0) {
+        goto fail;
+    }
+    if (!quiet)
+        printf("Updated UID map: %s\n", map_path);
+
+
+    c->stage = "gid_map";
+    snprintf(map_path, PATH_MAX, "/proc/%ld/gid_map", (intmax_t) c->pid);
+    proc_setgroups_write(c->pid, "deny");
+    if (!quiet)
+        printf("Setgroups set to deny for: %s\n", map_path);
+    if (update_map(CONTAINER_ID_MAP, map_path) != 0) {
+        goto fail;
+    }
+    if (!quiet)
+        printf("Updated GID map: %s\n", map_path);
+
+    // Create and configure the container's own cgroup, named after its root
+    // unless --name was given. container_start() has created it already.
+    c->stage = "cgroup";
+    if (!c->cgroup_path[0] && create_container_cgroup(c->cgroup_path, sizeof(c->cgroup_path), c->name) != 0) {
+        c->cgroup_path[0] = '\0';
+        goto fail;
+    }
+    if (apply_memory_profile(c->cgroup_path, &opts->memory) != 0) {
+        goto fail;
+    }
+    char cpu_max[32];
+    if (opts->cpuset && opts->cpus <= 0)
+        snprintf(cpu_max, sizeof(cpu_max), "max 100000");
+    else
+        snprintf(cpu_max, sizeof(cpu_max), "%ld 100000", (long) ((opts->cpus > 0 ? opts->cpus : DEFAULT_CPUS) * 100000 + 0.5));
+    if (set_cgroup_value(c->cgroup_path, CGROUP_CPU_FILE, cpu_max) != 0) {
+        goto fail;
+    }
+    if (sched_place(c->slot, c->cgroup_path) != 0) {
+        goto fail;
+    }
+    if (add_pid_to_cgroup(c->cgroup_path, c->pid) != 0) {
+        goto fail;
+    }
+
+    // Counters are enabled before the child is released so the whole
+    // workload, including exec, is measured
+    if (opts->perf && perf_start(&c->perf, c->cgroup_path, c->pid) == 0) {
+        c->perf_active = 1;
+    }
+
+    kops->close(c->pipefd[0]);
+    c->pipefd[0] = -1;
+
+    c->stage = "release";
+    if (kops->write(c->pipefd[1], "1", 1) != 1) {
+        perror("write");
+        goto fail;
+    }
+    kops->close(c->pipefd[1]);
+    c->pipefd[1] = -1;
+
+    if (c->slot)
+        state_publish(c->slot, c->name, c->pid, c->cgroup_path, c->temp_dir);
+
+    c->stage = NULL;
+    return 0;
+
+fail:
+    if (c->pid > 0) {
+        kops->kill(c->pid, SIGKILL);
+        kops->waitpid(c->pid, NULL, 0);
+    }
+    container_finish(c);
+    return -1;
+}
+
+// Tears down whatever container_start() created. The child must already
+// have been reaped.
+void container_finish(container *c)
+{
+    if (c->slot) {
+        state_release(c->slot);
+        c->slot = NULL;
+    }
+    if (c->perf_active) {
+        perf_report(&c->perf, 0);
+        perf_stop(&c->perf);
+        c->perf_active = 0;
+    }
+    if (c->cgroup_path[0]) {
+        remove_container_cgroup(c->cgroup_path);
+    }
+    for (int i = 0; i < 2; i++) {
+        if (c->pipefd[i] >= 0)
+            kops->close(c->pipefd[i]);
+    }
+    mockring_unmap(&c->ring);
+    if (c->ring_fd >= 0) {
+        close(c->ring_fd);
+        c->ring_fd = -1;
+    }
+    if (c->fan_fd >= 0) {
+        close(c->fan_fd);
+        c->fan_fd = -1;
+    }
+
+    if (c->temp_dir[0]) {
+        // Unmount /proc and remove the directory after the child process finishes
+        char proc_path[1024];
+        if (snprintf(proc_path, sizeof(proc_path), "%s/proc", c->temp_dir) >= sizeof(proc_path)) {
+            fprintf(stderr, "proc path too long\n");
+        } else if (kops->umount(proc_path) == -1 && errno != EINVAL && errno != ENOENT) {
+            // EINVAL: /proc was only ever mounted in the child's namespace
+            perror("umount /proc");
+        }
+
+        if (c->snapshot)
+            snapshot_forget(c->name);
+
+        // Remove temporary directory recursively
+        char remove_cmd[1024];
+        if (snprintf(remove_cmd, sizeof(remove_cmd), "rm -rf %s", c->temp_dir) >= sizeof(remove_cmd)) {
+            fprintf(stderr, "remove command too long\n");
+        } else if (system(remove_cmd) == -1) {
+            perror("rm -rf temp_dir");
+        }
+    }
+
+    free(c->stack);
+    free(c->cmd_args);
+    free(c->envp);
+    c->stack = NULL;
+    c->cmd_args = NULL;
+    c->envp = NULL;
+}
+
+// Feeds the supervisor's stdin to the container one line per request and
+// prints each response on its own line, keeping as many requests in flight
+// as the ring holds. Returns once stdin is exhausted and every request has
+// been answered (0), or once the workload exits, in which case it has been
+// reaped into *status (1).
+int ring_bridge(container *c, int *status)
+{
+    struct mockring_view *ring = &c->ring;
+    char in[65536];
+    size_t in_len = 0;
+    int eof = 0;
+    long outstanding = 0;
+    int reaped = 0;
+    char * resp = malloc(ring->resp.size / 2);
+    if (!resp) {
+        perror("malloc");
+        return -1;
+    }
+
+    while (!eof || outstanding > 0) {
+        int progress = 0;
+
+        if (!eof && in_len < sizeof(in)) {
+            struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+            if (poll(&pfd, 1, 0) > 0) {
+                ssize_t n = read(STDIN_FILENO, in + in_len, sizeof(in) - in_len);
+                if (n <= 0)
+                    eof = 1;
+                else
+                    in_len += n;
+                progress = 1;
+            }
+        }
+
+        // Send every complete line that fits
+        size_t start = 0;
+        for (;;) {
+            char *nl = memchr(in + start, '\n', in_len - start);
+            size_t len = nl ? (size_t) (nl - in - start) : in_len - start;
+            // A line longer than the buffer is sent as it is
+            if (!nl && !(eof && len > 0) && !(start == 0 && in_len == sizeof(in)))
+                break;
+            if (mockring_send(&ring->req, in + start, len) != 0) {
+                if (errno != EAGAIN) {
+                    perror("mockring_send");
+                    eof = 1;
+                    in_len = start;
+                }
+                break;
+            }
+            start += len + (nl ? 1 : 0);
+            outstanding++;
+            progress = 1;
+        }
+        memmove(in, in + start, in_len - start);
+        in_len -= start;
+        if (eof && in_len == 0 && !mockring_closed(&ring->req))
+            mockring_close(&ring->req);
+
+        int n;
+        while ((n = mockring_recv(&ring->resp, resp, ring->resp.size / 2)) >= 0) {
+            fwrite(resp, 1, n, stdout);
+            fputc('\n', stdout);
+            outstanding--;
+            progress = 1;
+        }
+        if (errno == EBADMSG || errno == EMSGSIZE) {
+            // The workload wrote a record we cannot read; nothing after it can be trusted
+            fprintf(stderr, "ring response queue corrupted, stopping the container\n");
+            kill(c->pid, SIGKILL);
+            break;
+        }
+
+        if (progress)
+            continue;
+        if (waitpid(c->pid, status, WNOHANG) == c->pid) {
+            reaped = 1;
+            break;
+        }
+        if (outstanding > 0)
+            mockring_wait_readable(&ring->resp, 10);
+        else {
+            struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+            poll(&pfd, 1, 10);
+        }
+    }
+    fflush(stdout);
+    free(resp);
+    if (!mockring_closed(&ring->req))
+        mockring_close(&ring->req);
+    return reaped;
+}
+
+int run_main(int argc, char ** args)
+{
+    char * first = args[0];
+
+    run_options opts = {0};
+    opts.memory = *find_memory_profile("default");
+    int cmd_index = 2;
+    while (cmd_index < argc && strncmp(args[cmd_index], "--", 2) == 0) {
+        int ret = parse_run_option(&opts, argc, args, &cmd_index);
+        if (ret == 0) {
+            fprintf(stderr, "Unrecognized option %s\n", args[cmd_index]);
+        }
+        if (ret != 1) {
+            return EXIT_FAILURE;
+        }
+    }
+    if (cmd_index >= argc) {
+        fprintf(stderr, "Usage: %s run [options] <command> <args>\n", first);
+        return EXIT_FAILURE;
+    }
+
+    container c;
+    if (container_start(&c, &opts, &args[cmd_index], argc - cmd_index, NULL) != 0) {
+        return EXIT_FAILURE;
+    }
+
+    if (c.fan_fd >= 0) {
+        boot_record_finish(c.temp_dir, opts.auto_deps, c.pid, c.fan_fd, opts.record_boot_ms, &args[cmd_index], argc - cmd_index);
+        c.fan_fd = -1;
+    }
+
+    int status;
+    int reaped = c.ring.ring ? ring_bridge(&c, &status) : 0;
+
+    // Wait for the child process to finish
+    if (reaped != 1 && supervise(c.pid, &status, &opts, c.cgroup_path, c.perf_active ? &c.perf : NULL) == -1) {
+        perror("waitpid");
+        container_finish(&c);
+        return EXIT_FAILURE;
+    }
+    container_finish(&c);
+
+    // Return the exit status of the child process
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    } else {
+        return EXIT_FAILURE;
+    }
+}
+
+// `mocker stress`: sustained container churn through the real
+// container_start()/container_finish() path, either closed loop (keep
+// --concurrency containers in flight) or open loop (--rate launches per
+// second, capped at --concurrency in flight).
+typedef struct stress_cause {
+    char what[96];
+    long count;
+} stress_cause;
+
+#define STRESS_MAX_CAUSES 16
+
+typedef struct stress_stats {
+    long launched;
+    long completed;
+    long failed;
+    long late;              // open loop launches behind schedule
+    long queued;            // launches that waited for the scheduler
+    double queue_ms_total;
+    double queue_ms_max;
+    long started;
+    double start_ms_total;
+    double start_ms_max;
+    stress_cause causes[STRESS_MAX_CAUSES];
+    int ncauses;
+} stress_stats;
+
+static void stress_count_failure(stress_stats *st, const char *what) {
+    st->failed++;
+    for (int i = 0; i < st->ncauses; i++) {
+        if (strcmp(st->causes[i].what, what) == 0) {
+            st->causes[i].count++;
+            return;
+        }
+    }
+    if (st->ncauses == STRESS_MAX_CAUSES)
+        what = "other";
+    int i = st->ncauses < STRESS_MAX_CAUSES ? st->ncauses++ : STRESS_MAX_CAUSES - 1;
+    snprintf(st->causes[i].what, sizeof(st->causes[i].what), "%s", what);
+    st->causes[i].count++;
+}
+
+static double monotonic_ms_precise(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static long self_rss_kb(void) {
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (!fp)
+        return 0;
+    long pages = 0, resident = 0;
+    if (fscanf(fp, "%ld %ld", &pages, &resident) != 2)
+        resident = 0;
+    fclose(fp);
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static double self_cpu_ms(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec * 1000.0 + ru.ru_utime.tv_usec / 1000.0 +
+           ru.ru_stime.tv_sec * 1000.0 + ru.ru_stime.tv_usec / 1000.0;
+}
+
+// Leak accounting: what the host looks like from outside the containers.
+// Mounts are not counted. The only mount is the container's /proc, made in
+// a mount namespace owned by the container's user namespace, so the kernel
+// turns its shared mounts into slaves and nothing propagates to the host.
+typedef struct host_residue {
+    long temp_dirs;
+    long cgroups;
+} host_residue;
+
+static void count_host_residue(host_residue *hr) {
+    memset(hr, 0, sizeof(*hr));
+    glob_t g;
+    if (glob("/tmp/mocker??????", GLOB_ONLYDIR, NULL, &g) == 0) {
+        hr->temp_dirs = g.gl_pathc;
+        globfree(&g);
+    }
+    if (glob(CGROUP_PATH "/mocker??????", GLOB_ONLYDIR, NULL, &g) == 0) {
+        hr->cgroups = g.gl_pathc;
+        globfree(&g);
+    }
+}
+
+int stress_main(int argc, char ** args)
+{
+    run_options opts = {0};
+    opts.memory = *find_memory_profile("default");
+    double rate = 0;
+    int concurrency = 0;
+    int duration_s = 10;
+
+    int cmd_index = 2;
+    while (cmd_index < argc && strncmp(args[cmd_index], "--", 2) == 0) {
+        char * opt = args[cmd_index];
+        if (strncmp(opt, "--rate=", 7) == 0) {
+            rate = atof(opt + 7);
+        } else if (strncmp(opt, "--concurrency=", 14) == 0) {
+            concurrency = atoi(opt + 14);
+        } else if (strncmp(opt, "--duration=", 11) == 0) {
+            duration_s = atoi(opt + 11);
+        } else {
+            int ret = parse_run_option(&opts, argc, args, &cmd_index);
+            if (ret == 0) {
+                fprintf(stderr, "Unrecognized option %s\n", opt);
+            }
+            if (ret != 1) {
+                return EXIT_FAILURE;
+            }
+            continue;
+        }
+        cmd_index++;
+    }
+    if (concurrency <= 0)
+        concurrency = rate > 0 ? 256 : 8;
+    if (opts.perf || opts.name || opts.ring_size || opts.record_boot_ms) {
+        fprintf(stderr, "--perf, --name, --ring and --record-boot are not supported by stress\n");
+        return EXIT_FAILURE;
+    }
+
+    static char * default_cmd[] = { "true", NULL };
+    char ** cmd = cmd_index < argc ? &args[cmd_index] : default_cmd;
+    int cmd_count = cmd_index < argc ? argc - cmd_index : 1;
+
+    container * slots = calloc(concurrency, sizeof(container));
+    if (!slots) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < concurrency; i++)
+        slots[i].pid = -1;
+
+    quiet = 1;
+    host_residue before, after;
+    count_host_residue(&before);
+
+    stress_stats st;
+    memset(&st, 0, sizeof(st));
+    int inflight = 0;
+    double t0 = monotonic_ms_precise();
+    double end = t0 + duration_s * 1000.0;
+    double next_launch = t0;
+    double next_sample = t0 + 1000.0;
+    double last_sample = t0;
+    double last_cpu = self_cpu_ms();
+    long last_completed = 0;
+    state_slot * pending = NULL;    // next launch's place in the scheduler's queue
+    int admitted = 0;
+    double queued_since = 0;
+
+    printf("%8s %10s %10s %8s %8s %8s %8s\n", "time_s", "launched", "completed", "failed", "rate/s", "cpu%", "rss_kb");
+    for (;;) {
+        // Reap finished containers and tear them down
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (int i = 0; i < concurrency; i++) {
+                if (slots[i].pid != pid)
+                    continue;
+                container_finish(&slots[i]);
+                slots[i].pid = -1;
+                inflight--;
+                if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+                    st.completed++;
+                } else {
+                    char what[96];
+                    if (WIFEXITED(status))
+                        snprintf(what, sizeof(what), "workload exit status %d", WEXITSTATUS(status));
+                    else
+                        snprintf(what, sizeof(what), "workload killed by signal %d", WTERMSIG(status));
+                    stress_count_failure(&st, what);
+                }
+                break;
+            }
+        }
+
+        double now = monotonic_ms_precise();
+        if (now >= next_sample) {
+            double cpu = self_cpu_ms();
+            printf("%8.1f %10ld %10ld %8ld %8ld %8.1f %8ld\n", (now - t0) / 1000.0, st.launched, st.completed,
+                   st.failed, st.completed - last_completed, 100.0 * (cpu - last_cpu) / (now - last_sample),
+                   self_rss_kb());
+            fflush(stdout);
+            last_sample = now;
+            last_cpu = cpu;
+            last_completed = st.completed;
+            next_sample += 1000.0;
+        }
+
+        if (now >= end) {
+            if (pending) {
+                state_release(pending);
+                pending = NULL;
+            }
+            if (inflight == 0)
+                break;
+            usleep(1000);
+            continue;
+        }
+
+        if (inflight >= concurrency || (rate > 0 && now < next_launch)) {
+            double wait_ms = 1.0;
+            if (rate > 0 && inflight < concurrency && next_launch - now < wait_ms)
+                wait_ms = next_launch - now;
+            usleep(wait_ms * 1000);
+            continue;
+        }
+
+        // Admission is polled, so finished containers keep being reaped
+        // and free their reservations while the next launch waits
+        if (!admitted) {
+            int ret = sched_admit(&pending, &opts, 0);
+            if (ret == 1) {
+                if (queued_since == 0) {
+                    queued_since = now;
+                    st.queued++;
+                }
+                usleep(1000);
+                continue;
+            }
+            if (ret != 0) {
+                st.launched++;
+                stress_count_failure(&st, "admission rejected");
+                queued_since = 0;
+                if (rate > 0)
+                    next_launch += 1000.0 / rate;
+                else
+                    usleep(1000);
+                continue;
+            }
+            admitted = 1;
+            if (queued_since > 0) {
+                double waited = monotonic_ms_precise() - queued_since;
+                st.queue_ms_total += waited;
+                if (waited > st.queue_ms_max)
+                    st.queue_ms_max = waited;
+                queued_since = 0;
+            }
+        }
+        if (rate > 0 && now - next_launch > 1.0)
+            st.late++;
+
+        int slot = 0;
+        while (slots[slot].pid != -1)
+            slot++;
+        double started = monotonic_ms_precise();
+        st.launched++;
+        int ret = container_start(&slots[slot], &opts, cmd, cmd_count, pending);
+        pending = NULL;
+        admitted = 0;
+        if (ret != 0) {
+            char what[96];
+            snprintf(what, sizeof(what), "%s failed", slots[slot].stage);
+            stress_count_failure(&st, what);
+            slots[slot].pid = -1;
+        } else {
+            inflight++;
+            st.started++;
+            double took = monotonic_ms_precise() - started;
+            st.start_ms_total += took;
+            if (took > st.start_ms_max)
+                st.start_ms_max = took;
+        }
+        if (rate > 0)
+            next_launch += 1000.0 / rate;
+    }
+
+    double elapsed_s = (monotonic_ms_precise() - t0) / 1000.0;
+    count_host_residue(&after);
+
+    printf("\nlaunched %ld, completed %ld, failed %ld in %.1f s\n", st.launched, st.completed, st.failed, elapsed_s);
+    printf("achieved %.1f containers/s", st.completed / elapsed_s);
+    if (rate > 0)
+        printf(" (target %.1f/s, %ld launches behind schedule, --concurrency=%d)", rate, st.late, concurrency);
+    printf("\n");
+    if (st.started > 0)
+        printf("start latency avg %.2f ms, max %.2f ms\n", st.start_ms_total / st.started, st.start_ms_max);
+    if (st.queued > 0)
+        printf("%ld launches waited for capacity, avg %.2f ms, max %.2f ms\n", st.queued,
+               st.queue_ms_total / st.queued, st.queue_ms_max);
+    for (int i = 0; i < st.ncauses; i++)
+        printf("  %6ld x %s\n", st.causes[i].count, st.causes[i].what);
+    printf("leaked: %ld temp dirs, %ld cgroups\n",
+           after.temp_dirs - before.temp_dirs, after.cgroups - before.cgroups);
+
+    free(slots);
+    return st.failed == 0 && after.temp_dirs == before.temp_dirs && after.cgroups == before.cgroups ?
+           EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int double_cmp(const void *a, const void *b) {
+    double da = *(const double *) a, db = *(const double *) b;
+    return da < db ? -1 : da > db;
+}
+
+static double percentile(const double *sorted, int n, int pct) {
+    return n ? sorted[(n - 1) * pct / 100] : 0;
+}
+
+// Launch cost against supervisor size: for each --heap size the supervisor
+// allocates and touches that much memory, then starts and reaps --launches
+// containers with each launch mode, timing clone(), the whole start and
+// the time until the command has exited and been reaped, which includes
+// what --init adds. With --init only the fork mode is measured.
+int launch_bench_main(int argc, char ** args)
+{
+    run_options opts = {0};
+    opts.memory = *find_memory_profile("default");
+    const char * heaps = "0,256M,1G,2G";
+    int launches = 20;
+
+    int cmd_index = 2;
+    while (cmd_index < argc && strncmp(args[cmd_index], "--", 2) == 0) {
+        char * opt = args[cmd_index];
+        if (strncmp(opt, "--heap=", 7) == 0) {
+            heaps = opt + 7;
+        } else if (strncmp(opt, "--launches=", 11) == 0) {
+            launches = atoi(opt + 11);
+        } else {
+            int ret = parse_run_option(&opts, argc, args, &cmd_index);
+            if (ret == 0) {
+                fprintf(stderr, "Unrecognized option %s\n", opt);
+            }
+            if (ret != 1) {
+                return EXIT_FAILURE;
+            }
+            continue;
+        }
+        cmd_index++;
+    }
+    if (launches <= 0 || opts.perf || opts.name || opts.ring_size || opts.record_boot_ms) {
+        fprintf(stderr, "--launches must be positive; --perf, --name, --ring and --record-boot are not supported by launch-bench\n");
+        return EXIT_FAILURE;
+    }
+
+    static char * default_cmd[] = { "true", NULL };
+    char ** cmd = cmd_index < argc ? &args[cmd_index] : default_cmd;
+    int cmd_count = cmd_index < argc ? argc - cmd_index : 1;
+
+    double * clone_ms = calloc(launches, sizeof(double));
+    double * start_ms = calloc(launches, sizeof(double));
+    double * exit_ms = calloc(launches, sizeof(double));
+    if (!clone_ms || !start_ms || !exit_ms) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+
+    quiet = 1;
+    printf("%10s %10s %6s %10s %10s %10s %10s %10s %7s\n", "heap", "rss_kb", "launch",
+           "clone_p50", "clone_p99", "start_p50", "start_p99", "exit_p50", "failed");
+    for (const char * h = heaps; *h; h += strcspn(h, ",") + (h[strcspn(h, ",")] == ',')) {
+        long long size = parse_bytes(h);
+        if (size < 0) {
+            fprintf(stderr, "bad heap size %.*s\n", (int) strcspn(h, ","), h);
+            break;
+        }
+        char * heap = size ? malloc(size) : NULL;
+        if (size && !heap) {
+            perror("malloc heap");
+            break;
+        }
+        if (heap)
+            memset(heap, 1, size);   // fault in every page
+
+        for (int vm = 0; vm <= !opts.init; vm++) {
+            opts.launch_vm = vm;
+            int n = 0, failed = 0;
+            for (int i = 0; i < launches; i++) {
+                container c;
+                struct timespec start;
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                if (container_start(&c, &opts, cmd, cmd_count, NULL) != 0) {
+                    failed++;
+                    continue;
+                }
+                start_ms[n] = elapsed_ms(&start);
+                clone_ms[n] = c.clone_ms;
+                waitpid(c.pid, NULL, 0);
+                exit_ms[n++] = elapsed_ms(&start);
+                container_finish(&c);
+            }
+            qsort(clone_ms, n, sizeof(double), double_cmp);
+            qsort(start_ms, n, sizeof(double), double_cmp);
+            qsort(exit_ms, n, sizeof(double), double_cmp);
+            printf("%10.*s %10ld %6s %10.3f %10.3f %10.3f %10.3f %10.3f %7d\n", (int) strcspn(h, ","), h, self_rss_kb(),
+                   vm ? "vm" : opts.init ? "init" : "fork", percentile(clone_ms, n, 50), percentile(clone_ms, n, 99),
+                   percentile(start_ms, n, 50), percentile(start_ms, n, 99), percentile(exit_ms, n, 50), failed);
+            fflush(stdout);
+        }
+        free(heap);
+    }
+
+    free(clone_ms);
+    free(start_ms);
+    free(exit_ms);
+    return EXIT_SUCCESS;
+}
+
+// In-memory kernel for kernel-bench. Directories live in an open addressing
+// table keyed by path, each holding a few pseudo files. Writes need the
+// directory to exist, as on cgroupfs. clone() hands out pids without running
+// anything and creates /proc/<pid> so the id maps can be written.
+#define FAKE_DIRS 8192      // power of two
+#define FAKE_FILES 16
+#define FAKE_FD_BASE (1 << 24)
+
+typedef struct fake_file {
+    char name[32];
+    char value[64];
+} fake_file;
+
+typedef struct fake_dir {
+    char path[128];         // empty for a free bucket
+    uint32_t hash;
+    int nfiles;
+    fake_file files[FAKE_FILES];
+} fake_dir;
+
+enum { FAKE_MKDIR, FAKE_RMDIR, FAKE_WRITE, FAKE_READ, FAKE_CLONE, FAKE_OTHER, FAKE_OPS };
+static const char * fake_op_names[FAKE_OPS] = { "mkdir", "rmdir", "write", "read", "clone", "other" };
+
+static struct {
+    fake_dir * dirs;
+    size_t ndirs;
+    pid_t next_pid;
+    int next_fd;
+    uint64_t ops[FAKE_OPS];
+} fake;
+
+static uint32_t fake_hash(const char *path, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char) path[i]) * 16777619u;
+    return h;
+}
+
+// Returns the bucket holding path[0..len), or -1 with *slot set to the free
+// bucket it would go into.
+static long fake_find(const char *path, size_t len, size_t *slot) {
+    uint32_t h = fake_hash(path, len);
+    for (size_t i = h & (FAKE_DIRS - 1);; i = (i + 1) & (FAKE_DIRS - 1)) {
+        fake_dir *d = &fake.dirs[i];
+        if (!d->path[0]) {
+            if (slot)
+                *slot = i;
+            return -1;
+        }
+        if (d->hash == h && strncmp(d->path, path, len) == 0 && d->path[len] == '\0')
+            return i;
+    }
+}
+
+static long fake_parent(const char *path, const char **base) {
+    const char *slash = strrchr(path, '/');
+    *base = slash ? slash + 1 : path;
+    if (!slash || slash == path)
+        return -2;      // the root always exists
+    return fake_find(path, slash - path, NULL);
+}
+
+static fake_file *fake_lookup_file(fake_dir *d, const char *name) {
+    for (int i = 0; i < d->nfiles; i++)
+        if (strcmp(d->files[i].name, name) == 0)
+            return &d->files[i];
+    return NULL;
+}
+
+static int fake_mkdir(const char *path, mode_t mode) {
+    (void) mode;
+    fake.ops[FAKE_MKDIR]++;
+    size_t len = strlen(path), slot;
+    const char *base;
+    if (fake_find(path, len, &slot) >= 0) {
+        errno = EEXIST;
+        return -1;
+    }
+    if (fake_parent(path, &base) == -1) {
+        errno = ENOENT;
+        return -1;
+    }
+    if (len >= sizeof(fake.dirs[0].path) || fake.ndirs >= FAKE_DIRS * 3 / 4) {
+        errno = ENOSPC;
+        return -1;
+    }
+    fake_dir *d = &fake.dirs[slot];
+    memcpy(d->path, path, len + 1);
+    d->hash = fake_hash(path, len);
+    d->nfiles = 0;
+    fake.ndirs++;
+    return 0;
+}
+
+static int fake_rmdir(const char *path) {
+    fake.ops[FAKE_RMDIR]++;
+    long i = fake_find(path, strlen(path), NULL);
+    if (i < 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    // Backward shift deletion keeps every probe chain intact
+    size_t hole = i, j = i;
+    for (;;) {
+        fake.dirs[hole].path[0] = '\0';
+        for (;;) {
+            j = (j + 1) & (FAKE_DIRS - 1);
+            if (!fake.dirs[j].path[0]) {
+                fake.ndirs--;
+                return 0;
+            }
+            size_t home = fake.dirs[j].hash & (FAKE_DIRS - 1);
+            int stays = hole <= j ? (hole < home && home <= j) : (hole < home || home <= j);
+            if (!stays)
+                break;
+        }
+        fake.dirs[hole] = fake.dirs[j];
+        hole = j;
+    }
+}
+
+static int fake_exists(const char *path) {
+    fake.ops[FAKE_OTHER]++;
+    if (fake_find(path, strlen(path), NULL) >= 0)
+        return 1;
+    const char *base;
+    long p = fake_parent(path, &base);
+    if (p < 0)
+        return 0;
+    // cgroupfs creates every interface file along with the directory
+    if (strncmp(path, "/sys/fs/cgroup/", 15) == 0)
+        return 1;
+    return fake_lookup_file(&fake.dirs[p], base) != NULL;
+}
+
+static ssize_t fake_write_file(const char *path, const char *buf, size_t len) {
+    fake.ops[FAKE_WRITE]++;
+    const char *base;
+    long p = fake_parent(path, &base);
+    if (p < 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    fake_dir *d = &fake.dirs[p];
+    fake_file *f = fake_lookup_file(d, base);
+    if (!f) {
+        if (d->nfiles == FAKE_FILES || strlen(base) >= sizeof(f->name)) {
+            errno = ENOSPC;
+            return -1;
+        }
+        f = &d->files[d->nfiles++];
+        strcpy(f->name, base);
+    }
+    size_t n = len < sizeof(f->value) - 1 ? len : sizeof(f->value) - 1;
+    memcpy(f->value, buf, n);
+    f->value[n] = '\0';
+    return len;
+}
+
+static ssize_t fake_read_file(const char *path, char *buf, size_t size) {
+    fake.ops[FAKE_READ]++;
+    const char *base;
+    long p = fake_parent(path, &base);
+    fake_file *f = p >= 0 ? fake_lookup_file(&fake.dirs[p], base) : NULL;
+    if (!f) {
+        errno = ENOENT;
+        return -1;
+    }
+    size_t n = strlen(f->value);
+    if (n > size)
+        n = size;
+    memcpy(buf, f->value, n);
+    return n;
+}
+
+static pid_t fake_clone(int (*fn)(void *), void *stack, int flags, void *arg) {
+    (void) fn;
+    (void) stack;
+    (void) flags;
+    (void) arg;
+    fake.ops[FAKE_CLONE]++;
+    pid_t pid = fake.next_pid++;
+    char path[32];
+    snprintf(path, sizeof(path), "/proc/%d", pid);
+    if (fake_mkdir(path, 0555) != 0)
+        return -1;
+    return pid;
+}
+
+static pid_t fake_waitpid(pid_t pid, int *status, int options) {
+    (void) options;
+    fake.ops[FAKE_OTHER]++;
+    char path[32];
+    snprintf(path, sizeof(path), "/proc/%d", pid);
+    if (fake_rmdir(path) != 0) {
+        errno = ECHILD;
+        return -1;
+    }
+    if (status)
+        *status = 0;
+    return pid;
+}
+
+static int fake_kill(pid_t pid, int sig) {
+    (void) pid;
+    (void) sig;
+    fake.ops[FAKE_OTHER]++;
+    return 0;
+}
+
+// The supervisor itself, as the owner of state table slots
+static pid_t fake_getpid(void) {
+    fake.ops[FAKE_OTHER]++;
+    return 1;
+}
+
+static int fake_setns(int fd, int nstype) {
+    (void) fd;
+    (void) nstype;
+    fake.ops[FAKE_OTHER]++;
+    return 0;
+}
+
+static int fake_unshare(int flags) {
+    (void) flags;
+    fake.ops[FAKE_OTHER]++;
+    return 0;
+}
+
+static int fake_mount(const char *source, const char *target, const char *fstype, unsigned long flags, const void *data) {
+    (void) source;
+    (void) target;
+    (void) fstype;
+    (void) flags;
+    (void) data;
+    fake.ops[FAKE_OTHER]++;
+    return 0;
+}
+
+static int fake_umount(const char *target) {
+    (void) target;
+    fake.ops[FAKE_OTHER]++;
+    errno = EINVAL;     // nothing is ever mounted in the supervisor's namespace
+    return -1;
+}
+
+static int fake_pipe(int fds[2]) {
+    fake.ops[FAKE_OTHER]++;
+    fds[0] = fake.next_fd++;
+    fds[1] = fake.next_fd++;
+    return 0;
+}
+
+static ssize_t fake_write(int fd, const void *buf, size_t len) {
+    (void) fd;
+    (void) buf;
+    fake.ops[FAKE_OTHER]++;
+    return len;
+}
+
+static int fake_close(int fd) {
+    (void) fd;
+    fake.ops[FAKE_OTHER]++;
+    return 0;
+}
+
+static const kernel_ops fake_kernel = {
+    "fake", fake_mkdir, fake_rmdir, fake_exists, fake_write_file, fake_read_file, fake_clone,
+    fake_kill, fake_getpid, fake_waitpid, fake_setns, fake_unshare, fake_mount, fake_umount, fake_pipe, fake_write, fake_close,
+};
+
+static int fake_kernel_init(void) {
+    fake.dirs = calloc(FAKE_DIRS, sizeof(fake_dir));
+    if (!fake.dirs)
+        return -1;
+    fake.next_pid = 1000;
+    fake.next_fd = FAKE_FD_BASE;
+    const char * seed[] = { "/proc", "/sys", "/sys/fs", "/sys/fs/cgroup" };
+    for (size_t i = 0; i < sizeof(seed) / sizeof(seed[0]); i++)
+        fake_mkdir(seed[i], 0755);
+    const char * meminfo = "MemTotal:        8388608 kB\n";
+    fake_write_file("/proc/meminfo", meminfo, strlen(meminfo));
+    memset(fake.ops, 0, sizeof(fake.ops));
+    return 0;
+}
+
+// Runs admission, container_launch() and container_finish() against the
+// fake kernel: scheduling, name and path building, option handling, cgroup
+// configuration, id maps, state table bookkeeping and teardown, without any
+// kernel time. The state
+// table is an anonymous mapping so the real one is left alone.
+int kernel_bench_main(int argc, char ** args)
+{
+    run_options opts = {0};
+    opts.memory = *find_memory_profile("default");
+    long launches = 1000000;
+
+    int i = 2;
+    while (i < argc) {
+        if (strncmp(args[i], "--launches=", 11) == 0) {
+            launches = atol(args[i] + 11);
+            i++;
+            continue;
+        }
+        int ret = parse_run_option(&opts, argc, args, &i);
+        if (ret == 0)
+            fprintf(stderr, "Unrecognized option %s\n", args[i]);
+        if (ret != 1)
+            return EXIT_FAILURE;
+    }
+    if (launches <= 0 || opts.perf || opts.pod || opts.ring_size || opts.record_boot_ms || opts.auto_deps || opts.image || opts.snapshot) {
+        fprintf(stderr, "--launches must be positive; options that need a real root, pod, ring or PMU are not supported by kernel-bench\n");
+        return EXIT_FAILURE;
+    }
+    // The hugetlb limits are discovered by listing the real cgroup directory
+    opts.memory.hugetlb_max = NULL;
+
+    if (fake_kernel_init() != 0) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+    state = mmap(NULL, sizeof(state_table), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (state == MAP_FAILED) {
+        perror("mmap");
+        return EXIT_FAILURE;
+    }
+    state->magic = STATE_MAGIC;
+    state_init(state);
+    kops = &fake_kernel;
+    quiet = 1;
+
+    static char * cmd[] = { "true", NULL };
+    char name[32];
+    long failed = 0;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long n = 0; n < launches; n++) {
+        container c;
+        container_reset(&c);
+        snprintf(name, sizeof(name), "bench%ld", n);
+        c.name = name;
+        if (sched_admit(&c.slot, &opts, 0) != 0 || container_launch(&c, &opts, cmd, 1) != 0) {
+            failed++;
+            continue;
+        }
+        kops->waitpid(c.pid, NULL, 0);
+        container_finish(&c);
+    }
+    double ms = elapsed_ms(&start);
+    kops = &real_kernel;
+
+    printf("%ld simulated launches in %.1f ms: %.0f launches/s, %.0f ns per launch, %ld failed\n",
+           launches, ms, launches / ms * 1000, ms * 1e6 / launches, failed);
+    printf("kernel calls per launch:");
+    for (int op = 0; op < FAKE_OPS; op++)
+        printf(" %s %.1f", fake_op_names[op], (double) fake.ops[op] / launches);
+    printf("\n");
+    free(fake.dirs);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int get_cgroup_value(const char *cgroup_path, const char *file, char *buf, size_t size) {
+    char filepath[PATH_MAX];
+    snprintf(filepath, sizeof(filepath), "%s/%s", cgroup_path, file);
+    ssize_t n = kops->read_file(filepath, buf, size - 1);
+    if (n < 0)
+        return -1;
+    buf[n] = '\0';
+    return 0;
+}
+
+// Resolves a container name to its cgroup, which is how running containers
+// are found from another mocker process.
+int container_cgroup_path(const char *name, char *cgroup_path, size_t size) {
+    if (!valid_name(name) || snprintf(cgroup_path, size, "%s/%s", CGROUP_PATH, name) >= size) {
+        fprintf(stderr, "invalid container name %s\n", name);
+        return -1;
+    }
+    if (!kops->exists(cgroup_path)) {
+        fprintf(stderr, "container %s is not running\n", name);
+        return -1;
+    }
+    return 0;
+}
+
+// cgroup.events raises POLLPRI on every change, so the transition is
+// observed without busy polling.
+static int cgroup_wait_frozen(const char *cgroup_path, int frozen, int timeout_ms) {
+    char filepath[PATH_MAX];
+    snprintf(filepath, sizeof(filepath), "%s/cgroup.events", cgroup_path);
+    int fd = open(filepath, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        perror("open cgroup.events");
+        return -1;
+    }
+    char want[16];
+    snprintf(want, sizeof(want), "frozen %d", frozen);
+    long deadline = monotonic_ms() + timeout_ms;
+    for (;;) {
+        char buf[256];
+        ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+        if (n < 0) {
+            perror("read cgroup.events");
+            break;
+        }
+        buf[n] = '\0';
+        if (strstr(buf, want)) {
+            close(fd);
+            return 0;
+        }
+        long left = deadline - monotonic_ms();
+        if (left <= 0) {
+            fprintf(stderr, "timed out waiting for %s\n", want);
+            break;
+        }
+        struct pollfd pfd = { .fd = fd, .events = POLLPRI };
+        poll(&pfd, 1, left);
+    }
+    close(fd);
+    return -1;
+}
+
+int container_pause(const char *name, const char *reclaim) {
+    char cgroup_path[256];
+    if (container_cgroup_path(name, cgroup_path, sizeof(cgroup_path)) != 0)
+        return -1;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (set_cgroup_value(cgroup_path, CGROUP_FREEZE_FILE, "1") != 0)
+        return -1;
+    if (cgroup_wait_frozen(cgroup_path, 1, 5000) != 0)
+        return -1;
+    printf("paused %s in %.3f ms\n", name, elapsed_ms(&start));
+    state_set_status(name, SLOT_PAUSED);
+
+    if (!reclaim)
+        return 0;
+
+    // With everything frozen nothing refaults, so reclaim can take the
+    // whole working set; "all" asks for memory.current
+    char before[32] = "0", after[32] = "0";
+    get_cgroup_value(cgroup_path, CGROUP_MEMORY_CURRENT_FILE, before, sizeof(before));
+    before[strcspn(before, "\n")] = '\0';
+    const char *amount = strcmp(reclaim, "all") == 0 ? before : reclaim;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    char filepath[PATH_MAX];
+    snprintf(filepath, sizeof(filepath), "%s/%s", cgroup_path, CGROUP_RECLAIM_FILE);
+    int fd = open(filepath, O_WRONLY | O_CLOEXEC);
+    if (fd == -1) {
+        perror("open memory.reclaim");
+        return -1;
+    }
+    // EAGAIN: reclaimed less than asked, which is expected for "all"
+    if (write(fd, amount, strlen(amount)) == -1 && errno != EAGAIN) {
+        perror("write memory.reclaim");
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    get_cgroup_value(cgroup_path, CGROUP_MEMORY_CURRENT_FILE, after, sizeof(after));
+    printf("reclaimed %s: memory.current %llu -> %llu bytes in %.3f ms\n", name,
+           strtoull(before, NULL, 10), strtoull(after, NULL, 10), elapsed_ms(&start));
+    return 0;
+}
+
+int container_resume(const char *name) {
+    char cgroup_path[256];
+    if (container_cgroup_path(name, cgroup_path, sizeof(cgroup_path)) != 0)
+        return -1;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (set_cgroup_value(cgroup_path, CGROUP_FREEZE_FILE, "0") != 0)
+        return -1;
+    if (cgroup_wait_frozen(cgroup_path, 0, 5000) != 0)
+        return -1;
+    printf("resumed %s in %.3f ms\n", name, elapsed_ms(&start));
+    state_set_status(name, SLOT_RUNNING);
+    return 0;
+}
+
+int pause_main(int argc, char ** args) {
+    int resume = strcmp(args[1], "resume") == 0;
+    const char * reclaim = NULL;
+    const char * name = NULL;
+    for (int i = 2; i < argc; i++) {
+        if (!resume && strcmp(args[i], "--reclaim") == 0)
+            reclaim = "all";
+        else if (!resume && strncmp(args[i], "--reclaim=", 10) == 0)
+            reclaim = args[i] + 10;
+        else if (!name && args[i][0] != '-')
+            name = args[i];
+        else {
+            name = NULL;
+            break;
+        }
+    }
+    if (!name) {
+        fprintf(stderr, "Usage: %s pause [--reclaim[=<bytes>]] <name>\n       %s resume <name>\n", args[0], args[0]);
+        return EXIT_FAILURE;
+    }
+    int ret = resume ? container_resume(name) : container_pause(name, reclaim);
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Finds the root of a running container through a process in its cgroup.
+int container_root(const char *name, char *root, size_t size) {
+    char cgroup_path[256];
+    if (container_cgroup_path(name, cgroup_path, sizeof(cgroup_path)) != 0)
+        return -1;
+    char procs[4096];
+    if (get_cgroup_value(cgroup_path, CGROUP_PROCS_FILE, procs, sizeof(procs)) != 0 || !procs[0]) {
+        fprintf(stderr, "container %s has no processes\n", name);
+        return -1;
+    }
+    // The trailing "/." makes nftw() follow the magic link
+    snprintf(root, size, "/proc/%ld/root/.", strtol(procs, NULL, 10));
+    return 0;
+}
+
+typedef struct commit_walk {
+    const char * root;
+    int root_fd;
+    const char * staging;
+    manifest * base;
+    long changed;
+    long deleted;
+    int failed;
+} commit_walk;
+
+static commit_walk * walk_commit;
+
+static int commit_visit(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void) type;
+    commit_walk *cw = walk_commit;
+    if (ftw->level == 0)
+        return 0;
+    const char *rel = path + strlen(cw->root);
+    char link[PATH_MAX] = "";
+    if (S_ISLNK(st->st_mode)) {
+        ssize_t n = readlink(path, link, sizeof(link) - 1);
+        link[n > 0 ? n : 0] = '\0';
+    }
+    manifest_entry *old = manifest_find(cw->base, rel);
+    if (old)
+        old->seen = 1;
+    if (old && !entry_changed(old, st, link))
+        return 0;
+
+    // Replaced with something else: the old entry has to be hidden first
+    if (old && S_ISDIR(st->st_mode) && S_ISDIR(old->mode) && old->ino != st->st_ino) {
+        if (stage_marker(cw->staging, rel, WHITEOUT_OPAQUE) != 0)
+            goto fail;
+    } else if (old && (old->mode & S_IFMT) != (st->st_mode & S_IFMT)) {
+        char dir[PATH_MAX], marker[NAME_MAX + 8];
+        snprintf(dir, sizeof(dir), "%.*s", (int) (ftw->base - (rel - path)), rel);
+        snprintf(marker, sizeof(marker), "%s%s", WHITEOUT_PREFIX, path + ftw->base);
+        if (stage_marker(cw->staging, dir, marker) != 0)
+            goto fail;
+    }
+    if (stage_entry(cw->root_fd, cw->staging, rel) != 0)
+        goto fail;
+    cw->changed++;
+    return 0;
+
+fail:
+    fprintf(stderr, "ERROR: stage %s: %s\n", rel, strerror(errno));
+    cw->failed = 1;
+    return -1;
+}
+
+static int sha256_file(const char *path, char *hex, size_t size) {
+    char out[256];
+    char * argv[] = { "sha256sum", (char *) path, NULL };
+    if (size < 65 || run_argv(argv, out, sizeof(out)) != 0)
+        return -1;
+    snprintf(hex, 65, "%.64s", out);
+    if (!valid_digest(hex)) {
+        fprintf(stderr, "sha256sum %s: unexpected output\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+int container_commit(const char *name, const char *image) {
+    char root[64];
+    if (!valid_name(image)) {
+        fprintf(stderr, "invalid image name %s\n", image);
+        return -1;
+    }
+    if (container_root(name, root, sizeof(root)) != 0)
+        return -1;
+
+    manifest base;
+    char path[PATH_MAX];
+    container_state_path(path, sizeof(path), name, "manifest");
+    if (access(path, F_OK) != 0) {
+        fprintf(stderr, "%s was not started with --snapshot, so there is nothing to compare it to\n", name);
+        return -1;
+    }
+    if (manifest_load(path, &base) != 0)
+        return -1;
+
+    int root_fd = open(root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd == -1) {
+        perror("open container root");
+        manifest_free(&base);
+        return -1;
+    }
+    char staging[] = "/tmp/mocker-layerXXXXXX";
+    if (!mkdtemp(staging)) {
+        perror("mkdtemp");
+        manifest_free(&base);
+        close(root_fd);
+        return -1;
+    }
+
+    commit_walk cw = { root, root_fd, staging, &base, 0, 0, 0 };
+    walk_commit = &cw;
+    int ret = nftw(root, commit_visit, 64, FTW_PHYS | FTW_MOUNT);
+    if (ret == 0 && !cw.failed) {
+        // Whatever the walk did not see was deleted. Only the topmost
+        // deleted path needs a whiteout.
+        for (size_t i = 0; i < base.count && ret == 0; i++) {
+            manifest_entry *e = &base.entries[i];
+            if (e->seen)
+                continue;
+            int fd = open_in_root(root_fd, e->path, O_PATH | O_NOFOLLOW, 0, COMMIT_RESOLVE);
+            if (fd >= 0 || errno != ENOENT) {
+                if (fd >= 0)
+                    close(fd);
+                continue;   // mount points are skipped by the walk, not gone
+            }
+            char parent[PATH_MAX];
+            snprintf(parent, sizeof(parent), "%s", e->path);
+            char *slash = strrchr(parent, '/');
+            *slash = '\0';
+            manifest_entry *p = parent[0] ? manifest_find(&base, parent) : NULL;
+            if (p && !p->seen)
+                continue;
+            char marker[NAME_MAX + 8];
+            snprintf(marker, sizeof(marker), "%s%s", WHITEOUT_PREFIX, slash + 1);
+            if (stage_marker(staging, parent, marker) != 0) {
+                fprintf(stderr, "ERROR: whiteout %s: %s\n", e->path, strerror(errno));
+                ret = -1;
+            }
+            cw.deleted++;
+        }
+    } else {
+        ret = -1;
+    }
+    manifest_free(&base);
+    close(root_fd);
+
+    // Written next to the layers so it can be renamed into place
+    char layer_tmp[PATH_MAX], digest[65];
+    snprintf(layer_tmp, sizeof(layer_tmp), "%s/.incoming-%d.tar", LAYER_DIR, getpid());
+    if (ret == 0 && make_run_dir(LAYER_DIR) == 0 && make_run_dir(IMAGE_DIR) == 0) {
+        char * tar[] = { "tar", "--numeric-owner", "-C", staging, "-cf", layer_tmp, ".", NULL };
+        ret = run_argv(tar, NULL, 0);
+    } else {
+        ret = -1;
+    }
+    remove_tree(staging);
+
+    if (ret == 0)
+        ret = sha256_file(layer_tmp, digest, sizeof(digest));
+    if (ret == 0) {
+        // Layers are immutable: an identical one may already be stored
+        snprintf(path, sizeof(path), "%s/%s.tar", LAYER_DIR, digest);
+        if (rename(layer_tmp, path) == -1) {
+            perror("rename layer");
+            ret = -1;
+        }
+    }
+    unlink(layer_tmp);
+
+    if (ret == 0) {
+        // New image = the container's own image followed by the new layer
+        char layers[8192] = "";
+        char base_image[NAME_MAX + 1];
+        container_state_path(path, sizeof(path), name, "image");
+        FILE *fp = fopen(path, "r");
+        if (fp) {
+            if (fgets(base_image, sizeof(base_image), fp)) {
+                base_image[strcspn(base_image, "\n")] = '\0';
+                char image_path[PATH_MAX];
+                snprintf(image_path, sizeof(image_path), "%s/%s", IMAGE_DIR, base_image);
+                FILE *ip = fopen(image_path, "r");
+                if (ip) {
+                    size_t n = fread(layers, 1, sizeof(layers) - 1, ip);
+                    layers[n] = '\0';
+                    fclose(ip);
+                }
+            }
+            fclose(fp);
+        }
+        snprintf(path, sizeof(path), "%s/%s", IMAGE_DIR, image);
+        fp = fopen(path, "w");
+        if (!fp || fprintf(fp, "%s%s\n", layers, digest) < 0) {
+            perror("write image");
+            ret = -1;
+        }
+        if (fp && fclose(fp) != 0)
+            ret = -1;
+    }
+    if (ret == 0)
+        printf("committed %s as %s: layer sha256:%s (%ld changed, %ld deleted)\n",
+               name, image, digest, cw.changed, cw.deleted);
+    return ret;
+}
+
+int commit_main(int argc, char ** args) {
+    if (argc != 4) {
+        fprintf(stderr, "Usage: %s commit <name> <image>\n", args[0]);
+        return EXIT_FAILURE;
+    }
+    return container_commit(args[2], args[3]) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// mocker cp. On the container side every path is resolved with
+// openat2(RESOLVE_IN_ROOT) against a dirfd of the container's root, so
+// "..", absolute symlinks and magic links are all confined to it. The tree
+// is walked once to create directories and symlinks, then the regular files
+// are copied by a pool of threads with copy_fd().
+typedef struct cp_side {
+    int root_fd;            // AT_FDCWD on the host
+    uint64_t resolve;       // RESOLVE_* flags for every lookup
+} cp_side;
+
+typedef struct cp_job {
+    char * src;
+    char * dst;
+    off_t size;
+} cp_job;
+
+typedef struct cp_dir {
+    char * path;
+    mode_t mode;
+} cp_dir;
+
+typedef struct cp_state {
+    cp_side src;
+    cp_side dst;
+    cp_job * jobs;
+    size_t count;
+    size_t cap;
+    size_t next;            // next job to hand out, shared by the workers
+    cp_dir * dirs;          // created directories, for their final mode
+    size_t dir_count;
+    size_t dir_cap;
+    uint64_t bytes;
+    uint64_t methods[3];    // files copied with each COPY_* method
+    long failed;
+} cp_state;
+
+static int cp_open(const cp_side *side, const char *path, int flags, mode_t mode) {
+    return open_in_root(side->root_fd, path, flags, mode, side->resolve);
+}
+
+// Opens the parent directory of path and points *name at its last
+// component. path must not end in '/'.
+static int cp_open_parent(const cp_side *side, const char *path, const char **name) {
+    const char *slash = strrchr(path, '/');
+    *name = slash ? slash + 1 : path;
+    if (!slash)
+        return cp_open(side, ".", O_PATH | O_DIRECTORY, 0);
+    char parent[PATH_MAX];
+    snprintf(parent, sizeof(parent), "%.*s", slash == path ? 1 : (int) (slash - path), path);
+    return cp_open(side, parent, O_PATH | O_DIRECTORY, 0);
+}
+
+static void cp_fail(cp_state *st, const char *what, const char *path) {
+    fprintf(stderr, "ERROR: %s %s: %s\n", what, path, strerror(errno));
+    __atomic_fetch_add(&st->failed, 1, __ATOMIC_RELAXED);
+}
+
+static int cp_add_job(cp_state *st, const char *src, const char *dst, off_t size) {
+    if (st->count == st->cap) {
+        size_t cap = st->cap ? st->cap * 2 : 256;
+        cp_job *jobs = realloc(st->jobs, sizeof(cp_job) * cap);
+        if (!jobs)
+            return -1;
+        st->jobs = jobs;
+        st->cap = cap;
+    }
+    cp_job *job = &st->jobs[st->count];
+    job->src = strdup(src);
+    job->dst = strdup(dst);
+    job->size = size;
+    if (!job->src || !job->dst) {
+        free(job->src);
+        free(job->dst);
+        return -1;
+    }
+    st->count++;
+    return 0;
+}
+
+static int cp_mkdir(cp_state *st, const char *dst, mode_t mode) {
+    const char *name;
+    int pfd = cp_open_parent(&st->dst, dst, &name);
+    if (pfd == -1)
+        return -1;
+    // Owner-writable until the files are in, the real mode is set last
+    int ret = mkdirat(pfd, name, 0700);
+    struct stat existing;
+    if (ret == -1 && errno == EEXIST && fstatat(pfd, name, &existing, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(existing.st_mode))
+        ret = 0;
+    close(pfd);
+    if (ret == 0) {
+        if (st->dir_count == st->dir_cap) {
+            size_t cap = st->dir_cap ? st->dir_cap * 2 : 64;
+            cp_dir *dirs = realloc(st->dirs, sizeof(cp_dir) * cap);
+            if (!dirs)
+                return -1;
+            st->dirs = dirs;
+            st->dir_cap = cap;
+        }
+        cp_dir *dirs = st->dirs;
+        dirs[st->dir_count].path = strdup(dst);
+        dirs[st->dir_count].mode = mode & 07777;
+        if (!dirs[st->dir_count].path)
+            return -1;
+        st->dir_count++;
+    }
+    return ret;
+}
+
+static int cp_symlink(cp_state *st, int src_fd, const char *dst) {
+    char target[PATH_MAX];
+    ssize_t n = readlinkat(src_fd, "", target, sizeof(target) - 1);
+    if (n < 0)
+        return -1;
+    target[n] = '\0';
+    const char *name;
+    int pfd = cp_open_parent(&st->dst, dst, &name);
+    if (pfd == -1)
+        return -1;
+    int ret = symlinkat(target, pfd, name);
+    if (ret == -1 && errno == EEXIST && unlinkat(pfd, name, 0) == 0)
+        ret = symlinkat(target, pfd, name);
+    close(pfd);
+    return ret;
+}
+
+static void cp_walk(cp_state *st, const char *src, const char *dst) {
+    int fd = cp_open(&st->src, src, O_PATH | O_NOFOLLOW, 0);
+    struct stat sb;
+    if (fd == -1 || fstat(fd, &sb) == -1) {
+        cp_fail(st, "open", src);
+        if (fd != -1)
+            close(fd);
+        return;
+    }
+
+    if (S_ISREG(sb.st_mode)) {
+        if (cp_add_job(st, src, dst, sb.st_size) != 0)
+            cp_fail(st, "queue", src);
+    } else if (S_ISLNK(sb.st_mode)) {
+        if (cp_symlink(st, fd, dst) != 0)
+            cp_fail(st, "symlink", dst);
+    } else if (S_ISDIR(sb.st_mode)) {
+        if (cp_mkdir(st, dst, sb.st_mode) != 0) {
+            cp_fail(st, "mkdir", dst);
+        } else {
+            int dfd = cp_open(&st->src, src, O_RDONLY | O_DIRECTORY | O_NOFOLLOW, 0);
+            DIR *d = dfd == -1 ? NULL : fdopendir(dfd);
+            struct dirent *dir;
+            if (!d) {
+                cp_fail(st, "opendir", src);
+                if (dfd != -1)
+                    close(dfd);
+            }
+            while (d && (dir = readdir(d)) != NULL) {
+                if (strcmp(dir->d_name, ".") == 0 || strcmp(dir->d_name, "..") == 0)
+                    continue;
+                char child_src[PATH_MAX], child_dst[PATH_MAX];
+                if (snprintf(child_src, sizeof(child_src), "%s/%s", src, dir->d_name) >= sizeof(child_src) ||
+                    snprintf(child_dst, sizeof(child_dst), "%s/%s", dst, dir->d_name) >= sizeof(child_dst)) {
+                    errno = ENAMETOOLONG;
+                    cp_fail(st, "walk", src);
+                    continue;
+                }
+                cp_walk(st, child_src, child_dst);
+            }
+            if (d)
+                closedir(d);
+        }
+    } else {
+        fprintf(stderr, "skipping special file %s\n", src);
+    }
+    close(fd);
+}
+
+static void *cp_worker(void *arg) {
+    cp_state *st = arg;
+    for (;;) {
+        size_t i = __atomic_fetch_add(&st->next, 1, __ATOMIC_RELAXED);
+        if (i >= st->count)
+            break;
+        cp_job *job = &st->jobs[i];
+        int in = cp_open(&st->src, job->src, O_RDONLY | O_NOFOLLOW, 0);
+        struct stat sb;
+        if (in == -1 || fstat(in, &sb) == -1) {
+            cp_fail(st, "open", job->src);
+            if (in != -1)
+                close(in);
+            continue;
+        }
+        int out = cp_open(&st->dst, job->dst, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, sb.st_mode & 07777);
+        if (out == -1) {
+            cp_fail(st, "create", job->dst);
+            close(in);
+            continue;
+        }
+        int method = copy_fd(in, out, sb.st_size);
+        close(in);
+        if (close(out) == -1 || method < 0) {
+            cp_fail(st, "copy", job->dst);
+            continue;
+        }
+        __atomic_fetch_add(&st->methods[method], 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&st->bytes, (uint64_t) sb.st_size, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+static int cp_job_cmp(const void *a, const void *b) {
+    off_t sa = ((const cp_job *) a)->size, sb = ((const cp_job *) b)->size;
+    return sa < sb ? 1 : sa > sb ? -1 : 0;
+}
+
+// Splits "name:/path" into a container side. Anything else is a host path;
+// a host path containing ':' can be written as "./a:b".
+static int cp_parse_side(const char *arg, cp_side *side, const char **path) {
+    const char *colon = strchr(arg, ':');
+    const char *slash = strchr(arg, '/');
+    side->root_fd = AT_FDCWD;
+    side->resolve = 0;
+    *path = arg;
+    if (!colon || (slash && slash < colon))
+        return 0;
+
+    char name[256];
+    snprintf(name, sizeof(name), "%.*s", (int) (colon - arg), arg);
+    char root[64];
+    if (container_root(name, root, sizeof(root)) != 0)
+        return -1;
+    side->root_fd = open(root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (side->root_fd == -1) {
+        perror("open container root");
+        return -1;
+    }
+    side->resolve = RESOLVE_IN_ROOT | RESOLVE_NO_MAGICLINKS;
+    *path = colon[1] ? colon + 1 : "/";
+    return 1;
+}
+
+int cp_main(int argc, char ** args) {
+    int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (jobs > 8)
+        jobs = 8;
+    int i = 2;
+    for (; i < argc && args[i][0] == '-'; i++) {
+        if (strncmp(args[i], "--jobs=", 7) == 0 && atoi(args[i] + 7) > 0)
+            jobs = atoi(args[i] + 7);
+        else
+            break;
+    }
+    if (argc - i != 2) {
+        fprintf(stderr, "Usage: %s cp [--jobs=N] <name>:<path> <host path>\n       %s cp [--jobs=N] <host path> <name>:<path>\n", args[0], args[0]);
+        return EXIT_FAILURE;
+    }
+
+    cp_state st;
+    memset(&st, 0, sizeof(st));
+    const char *src_arg, *dst_arg;
+    int src_in = cp_parse_side(args[i], &st.src, &src_arg);
+    int dst_in = src_in < 0 ? -1 : cp_parse_side(args[i + 1], &st.dst, &dst_arg);
+    int ret = EXIT_FAILURE;
+    if (src_in < 0 || dst_in < 0)
+        goto out;
+    if (src_in == dst_in) {
+        fprintf(stderr, "exactly one of source and destination must be <name>:<path>\n");
+        goto out;
+    }
+
+    char src[PATH_MAX], dst[PATH_MAX];
+    snprintf(src, sizeof(src), "%s", src_arg);
+    snprintf(dst, sizeof(dst), "%s", dst_arg);
+    for (size_t n = strlen(src); n > 1 && src[n - 1] == '/'; n--)
+        src[n - 1] = '\0';
+    for (size_t n = strlen(dst); n > 1 && dst[n - 1] == '/'; n--)
+        dst[n - 1] = '\0';
+
+    // Like cp(1): into an existing directory, under the source's name
+    int dst_fd = cp_open(&st.dst, dst, O_PATH | O_DIRECTORY, 0);
+    if (dst_fd != -1) {
+        close(dst_fd);
+        const char *base = strrchr(src, '/');
+        base = base ? base + 1 : src;
+        if (!base[0] || strcmp(base, ".") == 0 || strcmp(base, "..") == 0) {
+            fprintf(stderr, "cannot copy %s into a directory, name the destination\n", src);
+            goto out;
+        }
+        size_t len = strlen(dst);
+        if (snprintf(dst + len, sizeof(dst) - len, "%s%s", strcmp(dst, "/") == 0 ? "" : "/", base) >= (int) (sizeof(dst) - len)) {
+            fprintf(stderr, "destination path too long\n");
+            goto out;
+        }
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    cp_walk(&st, src, dst);
+
+    // Largest files first so one big file does not finish last on its own
+    qsort(st.jobs, st.count, sizeof(cp_job), cp_job_cmp);
+    if ((size_t) jobs > st.count)
+        jobs = st.count ? st.count : 1;
+    pthread_t *threads = calloc(jobs, sizeof(pthread_t));
+    int started = 0;
+    for (; threads && started < jobs - 1; started++) {
+        if (pthread_create(&threads[started], NULL, cp_worker, &st) != 0)
+            break;
+    }
+    cp_worker(&st);
+    for (int t = 0; t < started; t++)
+        pthread_join(threads[t], NULL);
+    free(threads);
+
+    // Deepest first, a read-only parent must not block its children
+    for (size_t d = st.dir_count; d-- > 0;) {
+        int fd = cp_open(&st.dst, st.dirs[d].path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW, 0);
+        if (fd == -1 || fchmod(fd, st.dirs[d].mode) == -1)
+            cp_fail(&st, "chmod", st.dirs[d].path);
+        if (fd != -1)
+            close(fd);
+    }
+
+    double ms = elapsed_ms(&start);
+    printf("copied %" PRIu64 " files, %.1f MB in %.1f ms (%.0f MB/s, %d threads): %" PRIu64 " cloned, %" PRIu64 " copy_file_range, %" PRIu64 " splice\n",
+           st.methods[COPY_CLONE] + st.methods[COPY_RANGE] + st.methods[COPY_SPLICE], st.bytes / 1e6, ms, ms > 0 ? st.bytes / 1e3 / ms : 0.0, started + 1,
+           st.methods[COPY_CLONE], st.methods[COPY_RANGE], st.methods[COPY_SPLICE]);
+    ret = st.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+
+out:
+    for (size_t j = 0; j < st.count; j++) {
+        free(st.jobs[j].src);
+        free(st.jobs[j].dst);
+    }
+    free(st.jobs);
+    for (size_t d = 0; d < st.dir_count; d++)
+        free(st.dirs[d].path);
+    free(st.dirs);
+    if (src_in > 0)
+        close(st.src.root_fd);
+    if (dst_in > 0)
+        close(st.dst.root_fd);
+    return ret;
+}
+
+static const char *state_status_name(const state_slot *s) {
+    if (!owner_alive(s->owner))
+        return "orphaned";   // its supervisor died before tearing it down
+    switch (s->status) {
+    case SLOT_PAUSED: return "paused";
+    case SLOT_QUEUED: return "queued";
+    case SLOT_STARTING: return "starting";
+    default: return "running";
+    }
+}
+
+static void format_uptime(char *buf, size_t size, int64_t started_ms) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    int64_t s = (now.tv_sec * 1000LL + now.tv_nsec / 1000000 - started_ms) / 1000;
+    if (s < 3600)
+        snprintf(buf, size, "%" PRId64 "m%02" PRId64 "s", s / 60, s % 60);
+    else
+        snprintf(buf, size, "%" PRId64 "h%02" PRId64 "m", s / 3600, s / 60 % 60);
+}
+
+int ps_main(int argc, char ** args) {
+    (void) argc;
+    (void) args;
+    state_table *table = state_map(0);
+    printf("%-20s %8s %8s %-9s %9s %-10s %s\n", "NAME", "PID", "SUPER", "STATUS", "UPTIME", "TENANT", "ROOT");
+    if (!table)
+        return EXIT_SUCCESS;
+    // Reservations as the scheduler would count them on its next scan
+    uint64_t mem = 0, cpu_milli = 0, cpuset[CPUSET_WORDS] = {0};
+    int queued = 0, torn = 0;
+    for (unsigned int i = 0; i < STATE_SLOTS; i++) {
+        state_slot s;
+        int used = state_read(&table->slots[i], &s);
+        torn += used < 0;
+        if (used <= 0 || s.status == SLOT_FREE)
+            continue;
+        int alive = owner_alive(s.owner);
+        if (alive && s.status == SLOT_QUEUED) {
+            queued++;
+        } else if (alive) {
+            mem += s.mem_bytes;
+            cpu_milli += s.cpu_milli;
+            for (int w = 0; w < CPUSET_WORDS; w++)
+                cpuset[w] |= s.cpuset[w];
+        }
+        // Queued and starting launches may not have a name yet
+        char uptime[32];
+        format_uptime(uptime, sizeof(uptime), s.started_ms);
+        printf("%-20s %8d %8d %-9s %9s %-10s %s\n", s.name[0] ? s.name : "-", s.pid, s.owner, state_status_name(&s),
+               uptime, s.tenant[0] ? s.tenant : "-", s.root[0] ? s.root : "-");
+    }
+    const host_capacity *hc = host_capacity_get();
+    printf("\nreserved: memory %" PRIu64 "M of %" PRIu64 "M, cpu.max %.2f of %d CPUs, cpuset %d CPUs; %d queued\n",
+           mem >> 20, hc->mem_bytes >> 20, cpu_milli / 1000.0, hc->ncpus, cpubit_count(cpuset), queued);
+    if (torn)
+        printf("%d slots are torn (a writer died while updating them) and were skipped\n", torn);
+    return EXIT_SUCCESS;
+}
+
+int inspect_main(int argc, char ** args) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s inspect <name>\n", args[0]);
+        return EXIT_FAILURE;
+    }
+    state_table *table = state_map(0);
+    for (unsigned int i = 0; table && i < STATE_SLOTS; i++) {
+        state_slot s;
+        if (state_read(&table->slots[i], &s) <= 0 || strcmp(s.name, args[2]) != 0)
+            continue;
+        time_t started = s.started_ms / 1000;
+        char when[64], uptime[32];
+        strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S%z", localtime(&started));
+        format_uptime(uptime, sizeof(uptime), s.started_ms);
+        printf("name:       %s\n", s.name);
+        printf("pid:        %d\n", s.pid);
+        printf("supervisor: %d\n", s.owner);
+        printf("status:     %s\n", state_status_name(&s));
+        printf("started:    %s (%s ago)\n", when, uptime);
+        printf("cgroup:     %s\n", s.cgroup_path);
+        printf("root:       %s\n", s.root);
+        char cpus[1024];
+        format_cpu_list(s.cpuset, cpus, sizeof(cpus));
+        printf("tenant:     %s\n", s.tenant);
+        printf("priority:   %s\n", s.priority == PRIO_HIGH ? "high" : s.priority == PRIO_LOW ? "low" : "normal");
+        printf("reserved:   memory %" PRIu64 "M, cpu.max %.2f CPUs, cpuset %s\n", s.mem_bytes >> 20, s.cpu_milli / 1000.0,
+               cpus[0] ? cpus : "-");
+        printf("slot:       %u\n", i);
+        return EXIT_SUCCESS;
+    }
+    fprintf(stderr, "no container named %s\n", args[2]);
+    return EXIT_FAILURE;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s run [options] <command> <args>\n", prog);
+    fprintf(stderr, "       %s pod create|rm <name>\n", prog);
+    fprintf(stderr, "       %s stress [--rate=N] [--concurrency=N] [--duration=S] [options] [command]\n", prog);
+    fprintf(stderr, "       %s kernel-bench [--launches=N] [options]\n", prog);
+    fprintf(stderr, "       %s launch-bench [--heap=<sizes>] [--launches=N] [options] [command]\n", prog);
+    fprintf(stderr, "       %s pause [--reclaim[=<bytes>]] <name>\n", prog);
+    fprintf(stderr, "       %s resume <name>\n", prog);
+    fprintf(stderr, "       %s ps\n", prog);
+    fprintf(stderr, "       %s inspect <name>\n", prog);
+    fprintf(stderr, "       %s commit <name> <image>\n", prog);
+    fprintf(stderr, "       %s cp [--jobs=N] <name>:<path> <host path> | <host path> <name>:<path>\n", prog);
+}
+
+int main(int argc, char ** args)
+{
+    char * first = args[0];
+
+    if (argc < 2) {
+        usage(first);
+        return EXIT_FAILURE;
+    }
+
+    char * second = args[1];
+
+    if (strcmp(second, "run") == 0)
+        return run_main(argc, args);
+    if (strcmp(second, "pod") == 0)
+        return pod_main(argc, args);
+    if (strcmp(second, "stress") == 0)
+        return stress_main(argc, args);
+    if (strcmp(second, "kernel-bench") == 0)
+        return kernel_bench_main(argc, args);
+    if (strcmp(second, "launch-bench") == 0)
+        return launch_bench_main(argc, args);
+    if (strcmp(second, "pause") == 0 || strcmp(second, "resume") == 0)
+        return pause_main(argc, args);
+    if (strcmp(second, "ps") == 0)
+        return ps_main(argc, args);
+    if (strcmp(second, "inspect") == 0)
+        return inspect_main(argc, args);
+    if (strcmp(second, "commit") == 0)
+        return commit_main(argc, args);
+    if (strcmp(second, "cp") == 0)
+        return cp_main(argc, args);
+
+    fprintf(stderr, "Unrecognized second argument.\n");
+    usage(first);
+    return EXIT_FAILURE;
 }
@@ -0,0 +1,377 @@
+// mockring.h - shared memory request channel between mocker and a warm
+// container.
+//
+// The supervisor creates a memfd holding two single-producer/single-consumer
+// byte rings (requests in, responses out) and passes it to the workload,
+// which finds the descriptor in $MOCKER_RING_FD. Messages are length
+// prefixed records. Nothing on the fast path makes a system call: a side
+// only calls futex() when it is about to sleep or when the other side has
+// announced that it is sleeping.
+//
+// The other side shares every byte of the mapping, so nothing read from it
+// is trusted: the size and position of each queue are copied into a private
+// mockring_view when the ring is created or attached, and each record is
+// bounds checked against those copies before it is read.
+//
+// Header only so workloads can include it without linking anything:
+//
+//     struct mockring_view ring;
+//     mockring_attach(&ring);
+//     char buf[4096];
+//     int n;
+//     while ((n = mockring_recv_wait(&ring.req, buf, sizeof(buf))) >= 0)
+//         mockring_send_wait(&ring.resp, buf, n);
+
+#ifndef MOCKRING_H
+#define MOCKRING_H
+
+#include <errno.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#define MOCKRING_MAGIC 0x676e726bu    // "krng"
+#define MOCKRING_VERSION 1
+#define MOCKRING_ENV "MOCKER_RING_FD"
+#define MOCKRING_PAD 0xffffffffu      // rest of the ring up to the end is unused
+#define MOCKRING_SPIN 256             // polls before a side goes to sleep
+
+// Positions are free running byte counters; `size` is a power of two so
+// position & (size - 1) is the offset. Each side writes only its own cache
+// line. A sleeping side waits on a sequence word the other side bumps
+// before waking it, so wakeups (including close) cannot be lost.
+struct mockring_queue {
+    _Alignas(64) _Atomic uint32_t head;         // consumed, written by the consumer
+    _Atomic uint32_t space_seq;                 // producer sleeps here
+    _Atomic uint32_t consumer_waiting;
+    _Alignas(64) _Atomic uint32_t tail;         // produced, written by the producer
+    _Atomic uint32_t data_seq;                  // consumer sleeps here
+    _Atomic uint32_t producer_waiting;
+    _Alignas(64) uint32_t size;
+    uint32_t offset;                            // data offset from the ring start
+    _Atomic uint32_t closed;                    // producer will send no more
+};
+
+struct mockring {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t total_size;
+    struct mockring_queue req;                  // supervisor -> container
+    struct mockring_queue resp;                 // container -> supervisor
+};
+
+// One queue as seen by one side; size and data never change after setup.
+struct mockring_port {
+    struct mockring_queue *q;
+    unsigned char *data;
+    uint32_t size;
+};
+
+struct mockring_view {
+    struct mockring *ring;                      // NULL: no ring
+    size_t map_size;
+    struct mockring_port req;
+    struct mockring_port resp;
+};
+
+static inline uint32_t mockring_record_size(uint32_t len) {
+    return (sizeof(uint32_t) + len + 7) & ~7u;
+}
+
+static inline void mockring_futex_wait(_Atomic uint32_t *addr, uint32_t expected, int timeout_ms) {
+    struct timespec ts = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+    // Not FUTEX_PRIVATE_FLAG: the word is shared between processes
+    syscall(SYS_futex, addr, FUTEX_WAIT, expected, timeout_ms < 0 ? NULL : &ts, NULL, 0);
+}
+
+static inline void mockring_futex_wake(_Atomic uint32_t *addr) {
+    syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+// Total bytes of shared memory for two queues of queue_size bytes each.
+static inline size_t mockring_region_size(uint32_t queue_size) {
+    return ((sizeof(struct mockring) + 63) & ~(size_t) 63) + 2 * (size_t) queue_size;
+}
+
+// Lays out a ring in mem, which must be mockring_region_size(queue_size)
+// bytes. queue_size must be a power of two of at least 4096.
+static inline int mockring_init(void *mem, uint32_t queue_size) {
+    if (queue_size < 4096 || (queue_size & (queue_size - 1)) || queue_size > (1u << 30)) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct mockring *ring = (struct mockring *) mem;
+    memset(ring, 0, sizeof(*ring));
+    uint32_t base = (sizeof(struct mockring) + 63) & ~63u;
+    ring->req.size = queue_size;
+    ring->req.offset = base;
+    ring->resp.size = queue_size;
+    ring->resp.offset = base + queue_size;
+    ring->total_size = base + 2 * queue_size;
+    ring->version = MOCKRING_VERSION;
+    atomic_thread_fence(memory_order_release);
+    ring->magic = MOCKRING_MAGIC;
+    return 0;
+}
+
+// Checks one queue of a mapping of map_size bytes and fills in its port.
+static inline int mockring_port_init(struct mockring_port *p, struct mockring *ring, struct mockring_queue *q,
+                                     uint32_t size, uint32_t offset, size_t map_size) {
+    if (size < 4096 || (size & (size - 1)) || size > (1u << 30) || (offset & 63) ||
+        offset < sizeof(struct mockring) || (uint64_t) offset + size > map_size) {
+        errno = EINVAL;
+        return -1;
+    }
+    p->q = q;
+    p->data = (unsigned char *) ring + offset;
+    p->size = size;
+    return 0;
+}
+
+// Fills in a view of the ring mapped at mem from the given layout.
+static inline int mockring_view_init(struct mockring_view *v, void *mem, size_t map_size, uint32_t req_size,
+                                     uint32_t req_offset, uint32_t resp_size, uint32_t resp_offset) {
+    struct mockring *ring = (struct mockring *) mem;
+    if (mockring_port_init(&v->req, ring, &ring->req, req_size, req_offset, map_size) != 0 ||
+        mockring_port_init(&v->resp, ring, &ring->resp, resp_size, resp_offset, map_size) != 0 ||
+        (req_offset < resp_offset ? (uint64_t) req_offset + req_size > resp_offset
+                                  : (uint64_t) resp_offset + resp_size > req_offset)) {
+        errno = EINVAL;
+        return -1;
+    }
+    v->ring = ring;
+    v->map_size = map_size;
+    return 0;
+}
+
+static inline void mockring_unmap(struct mockring_view *v) {
+    if (v->ring)
+        munmap(v->ring, v->map_size);
+    v->ring = NULL;
+}
+
+// Creates the memfd and maps it. The descriptor is left inheritable so it
+// survives into the container's execvp. The view is built from queue_size,
+// not read back from the shared header.
+static inline int mockring_create(struct mockring_view *v, uint32_t queue_size, int *fd_out) {
+    size_t size = mockring_region_size(queue_size);
+    uint32_t base = (sizeof(struct mockring) + 63) & ~63u;
+    int fd = syscall(SYS_memfd_create, "mocker-ring", 0);
+    if (fd == -1)
+        return -1;
+    if (ftruncate(fd, size) == -1) {
+        close(fd);
+        return -1;
+    }
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    if (mockring_init(mem, queue_size) != 0 ||
+        mockring_view_init(v, mem, size, queue_size, base, queue_size, base + queue_size) != 0) {
+        munmap(mem, size);
+        close(fd);
+        return -1;
+    }
+    *fd_out = fd;
+    return 0;
+}
+
+// Maps the ring passed by mocker through $MOCKER_RING_FD.
+static inline int mockring_attach(struct mockring_view *v) {
+    const char *env = getenv(MOCKRING_ENV);
+    if (!env) {
+        errno = ENOENT;
+        return -1;
+    }
+    int fd = atoi(env);
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        return -1;
+    if ((size_t) st.st_size < sizeof(struct mockring) || st.st_size > UINT32_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    void *mem = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED)
+        return -1;
+    struct mockring *ring = (struct mockring *) mem;
+    if (ring->magic != MOCKRING_MAGIC || ring->version != MOCKRING_VERSION || ring->total_size != st.st_size ||
+        mockring_view_init(v, mem, st.st_size, ring->req.size, ring->req.offset, ring->resp.size, ring->resp.offset) != 0) {
+        munmap(mem, st.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+// Appends one message. Returns 0, or -1 with EAGAIN when the queue is full,
+// EMSGSIZE when the message can never fit and EBADMSG when the other side
+// has left the positions in an impossible state.
+static inline int mockring_send(struct mockring_port *p, const void *buf, uint32_t len) {
+    struct mockring_queue *q = p->q;
+    uint32_t rec = mockring_record_size(len);
+    if (len > p->size || rec > p->size / 2) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    uint32_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+    uint32_t off = tail & (p->size - 1);
+    if (tail - head > p->size || (off & 7)) {
+        errno = EBADMSG;
+        return -1;
+    }
+    uint32_t to_end = p->size - off;
+    uint32_t need = rec <= to_end ? rec : to_end + rec;
+    if (p->size - (tail - head) < need) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    unsigned char *data = p->data;
+    if (rec > to_end) {
+        // Records never wrap; mark the tail end as padding and start over
+        uint32_t pad = MOCKRING_PAD;
+        memcpy(data + off, &pad, sizeof(pad));
+        tail += to_end;
+        off = 0;
+    }
+    memcpy(data + off, &len, sizeof(len));
+    memcpy(data + off + sizeof(len), buf, len);
+    // seq_cst pairs with the consumer's store to consumer_waiting so that
+    // either it sees the new tail or we see it waiting
+    atomic_store_explicit(&q->tail, tail + rec, memory_order_seq_cst);
+    if (atomic_load_explicit(&q->consumer_waiting, memory_order_seq_cst)) {
+        atomic_fetch_add_explicit(&q->data_seq, 1, memory_order_seq_cst);
+        mockring_futex_wake(&q->data_seq);
+    }
+    return 0;
+}
+
+// Takes one message. Returns its length, or -1 with EAGAIN when the queue
+// is empty, EPIPE when it is empty and closed, EMSGSIZE when buf is too
+// small (the message stays queued) and EBADMSG when a record or position
+// points outside the queue.
+static inline int mockring_recv(struct mockring_port *p, void *buf, uint32_t cap) {
+    struct mockring_queue *q = p->q;
+    uint32_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+    if (head == tail) {
+        errno = atomic_load_explicit(&q->closed, memory_order_acquire) &&
+                head == atomic_load_explicit(&q->tail, memory_order_acquire) ? EPIPE : EAGAIN;
+        return -1;
+    }
+
+    unsigned char *data = p->data;
+    uint32_t off = head & (p->size - 1);
+    uint32_t avail = tail - head;
+    uint32_t len;
+    if (avail > p->size || (off & 7)) {
+        errno = EBADMSG;
+        return -1;
+    }
+    memcpy(&len, data + off, sizeof(len));
+    if (len == MOCKRING_PAD) {
+        if (avail <= p->size - off) {
+            errno = EBADMSG;
+            return -1;
+        }
+        avail -= p->size - off;
+        head += p->size - off;
+        off = 0;
+        memcpy(&len, data, sizeof(len));
+    }
+    // The record has to lie inside the queue and inside what was produced
+    if ((uint64_t) off + sizeof(len) + len > p->size || (uint64_t) mockring_record_size(len) > avail) {
+        errno = EBADMSG;
+        return -1;
+    }
+    if (len > cap) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    memcpy(buf, data + off + sizeof(len), len);
+    atomic_store_explicit(&q->head, head + mockring_record_size(len), memory_order_seq_cst);
+    if (atomic_load_explicit(&q->producer_waiting, memory_order_seq_cst)) {
+        atomic_fetch_add_explicit(&q->space_seq, 1, memory_order_seq_cst);
+        mockring_futex_wake(&q->space_seq);
+    }
+    return (int) len;
+}
+
+// Sleeps until the queue has a message, is closed, or timeout_ms (-1:
+// forever) passes. Spins briefly first, since under load the next message
+// is usually microseconds away.
+static inline void mockring_wait_readable(struct mockring_port *p, int timeout_ms) {
+    struct mockring_queue *q = p->q;
+    for (int i = 0; i < MOCKRING_SPIN; i++) {
+        if (atomic_load_explicit(&q->head, memory_order_relaxed) != atomic_load_explicit(&q->tail, memory_order_acquire) ||
+            atomic_load_explicit(&q->closed, memory_order_acquire))
+            return;
+    }
+    uint32_t seq = atomic_load_explicit(&q->data_seq, memory_order_seq_cst);
+    atomic_store_explicit(&q->consumer_waiting, 1, memory_order_seq_cst);
+    if (atomic_load_explicit(&q->head, memory_order_relaxed) == atomic_load_explicit(&q->tail, memory_order_seq_cst) &&
+        !atomic_load_explicit(&q->closed, memory_order_seq_cst))
+        mockring_futex_wait(&q->data_seq, seq, timeout_ms);
+    atomic_store_explicit(&q->consumer_waiting, 0, memory_order_relaxed);
+}
+
+// Sleeps until the consumer has freed some space or timeout_ms passes.
+static inline void mockring_wait_writable(struct mockring_port *p, int timeout_ms) {
+    struct mockring_queue *q = p->q;
+    uint32_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+    for (int i = 0; i < MOCKRING_SPIN; i++) {
+        if (atomic_load_explicit(&q->head, memory_order_acquire) != head)
+            return;
+    }
+    uint32_t seq = atomic_load_explicit(&q->space_seq, memory_order_seq_cst);
+    atomic_store_explicit(&q->producer_waiting, 1, memory_order_seq_cst);
+    if (atomic_load_explicit(&q->head, memory_order_seq_cst) == head)
+        mockring_futex_wait(&q->space_seq, seq, timeout_ms);
+    atomic_store_explicit(&q->producer_waiting, 0, memory_order_relaxed);
+}
+
+static inline int mockring_send_wait(struct mockring_port *p, const void *buf, uint32_t len) {
+    while (mockring_send(p, buf, len) != 0) {
+        if (errno != EAGAIN)
+            return -1;
+        mockring_wait_writable(p, -1);
+    }
+    return 0;
+}
+
+// Blocking receive; returns -1 with EPIPE once the producer has closed the
+// queue and everything has been read.
+static inline int mockring_recv_wait(struct mockring_port *p, void *buf, uint32_t cap) {
+    int n;
+    while ((n = mockring_recv(p, buf, cap)) < 0) {
+        if (errno != EAGAIN)
+            return -1;
+        mockring_wait_readable(p, -1);
+    }
+    return n;
+}
+
+static inline int mockring_closed(const struct mockring_port *p) {
+    return atomic_load_explicit(&p->q->closed, memory_order_acquire) != 0;
+}
+
+static inline void mockring_close(struct mockring_port *p) {
+    struct mockring_queue *q = p->q;
+    atomic_store_explicit(&q->closed, 1, memory_order_seq_cst);
+    atomic_fetch_add_explicit(&q->data_seq, 1, memory_order_seq_cst);
+    mockring_futex_wake(&q->data_seq);
+}
+
+#endif
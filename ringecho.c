@@ -0,0 +1,38 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include "mockring.h"
+
+// Example warm container workload: answers every request on the ring
+// passed by `mocker run --ring` with the request upper-cased.
+int main() {
+    struct mockring_view ring;
+    if (mockring_attach(&ring) != 0) {
+        perror("mockring_attach");
+        return 1;
+    }
+
+    char *buf = malloc(ring.req.size / 2);
+    if (!buf) {
+        perror("malloc");
+        return 1;
+    }
+
+    long served = 0;
+    int n;
+    while ((n = mockring_recv_wait(&ring.req, buf, ring.req.size / 2)) >= 0) {
+        for (int i = 0; i < n; i++)
+            buf[i] = toupper((unsigned char) buf[i]);
+        if (mockring_send_wait(&ring.resp, buf, n) != 0) {
+            perror("mockring_send_wait");
+            return 1;
+        }
+        served++;
+    }
+
+    if (errno != EPIPE)
+        perror("mockring_recv_wait");
+    fprintf(stderr, "served %ld requests\n", served);
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <string.h>
+#include "mockring.h"
+
+// Checks that the receiving side of a ring rejects records and positions
+// a misbehaving peer has corrupted, instead of reading past its queue.
+// Exits 0 when every case passes.
+
+static int failures;
+
+static void expect(const char *what, int got, int want_errno) {
+    int ok = want_errno ? got == -1 && errno == want_errno : got >= 0;
+    printf("%-40s %s\n", what, ok ? "ok" : "FAIL");
+    if (!ok)
+        failures++;
+}
+
+// A fresh ring with one message queued on resp, as a workload would leave it.
+static void setup(struct mockring_view *v, int *fd) {
+    mockring_unmap(v);
+    if (*fd >= 0)
+        close(*fd);
+    if (mockring_create(v, 4096, fd) != 0) {
+        perror("mockring_create");
+        exit(1);
+    }
+    mockring_send(&v->resp, "hello", 5);
+}
+
+int main() {
+    struct mockring_view v = {0};
+    int fd = -1;
+    char buf[4096];
+
+    setup(&v, &fd);
+    expect("intact record", mockring_recv(&v.resp, buf, sizeof(buf)), 0);
+
+    setup(&v, &fd);
+    uint32_t len = 0x7ffffff0;
+    memcpy(v.resp.data, &len, sizeof(len));
+    expect("length past the queue", mockring_recv(&v.resp, buf, sizeof(buf)), EBADMSG);
+
+    setup(&v, &fd);
+    len = 64;
+    memcpy(v.resp.data, &len, sizeof(len));
+    expect("length past the produced bytes", mockring_recv(&v.resp, buf, sizeof(buf)), EBADMSG);
+
+    setup(&v, &fd);
+    atomic_store(&v.resp.q->tail, 1u << 20);
+    expect("tail far ahead of head", mockring_recv(&v.resp, buf, sizeof(buf)), EBADMSG);
+
+    setup(&v, &fd);
+    atomic_store(&v.resp.q->head, 3);
+    atomic_store(&v.resp.q->tail, 19);
+    expect("unaligned head", mockring_recv(&v.resp, buf, sizeof(buf)), EBADMSG);
+
+    setup(&v, &fd);
+    len = MOCKRING_PAD;
+    memcpy(v.resp.data, &len, sizeof(len));
+    expect("padding with nothing after it", mockring_recv(&v.resp, buf, sizeof(buf)), EBADMSG);
+
+    // The shared header is ignored once the view exists
+    setup(&v, &fd);
+    v.ring->resp.size = 1u << 30;
+    v.ring->resp.offset = 1u << 30;
+    expect("size and offset rewritten", mockring_recv(&v.resp, buf, sizeof(buf)), 0);
+
+    setup(&v, &fd);
+    atomic_store(&v.req.q->head, atomic_load(&v.req.q->tail) + 8192);
+    expect("send with head ahead of tail", mockring_send(&v.req, "x", 1), EBADMSG);
+
+    // The workload side validates the header when it attaches
+    setup(&v, &fd);
+    v.ring->req.offset = v.ring->total_size - 64;
+    snprintf(buf, sizeof(buf), "%d", fd);
+    setenv(MOCKRING_ENV, buf, 1);
+    struct mockring_view attached;
+    expect("attach with queue past the map", mockring_attach(&attached), EINVAL);
+
+    mockring_unmap(&v);
+    close(fd);
+    return failures ? 1 : 0;
+}